@@ -3,9 +3,13 @@
 //
 
 #include "include/generic_unsync_alloc.h"
+#include "include/shared_heap.h"
 #include <benchmark/benchmark.h>
 #include <iostream>
 #include <list>
+#include <string>
+#include <sys/wait.h>
+#include <unistd.h>
 #include <unordered_map>
 #include <vector>
 
@@ -96,7 +100,69 @@ static void BM_std_allocator(benchmark::State &s) {
 	}
 }
 
+struct Record {
+	uint64_t values[6];
+};
+
+// typed allocations through the runtime size path
+static void BM_typed_alloc_runtime(benchmark::State &s) {
+	cau::generic_allocator<cau::default_allocator> alloc;
+	Record                                        *records[64];
+	for (auto _: s) {
+		for (auto &record: records) {
+			record = alloc.alloc<Record>(1);
+			benchmark::DoNotOptimize(record);
+		}
+		for (auto *record: records) { alloc.dealloc(record, 1); }
+	}
+	s.SetItemsProcessed(int64_t(s.iterations()) * 64);
+}
+
+// same allocations with the size known at compile time, once inlined the runtime size is a constant as well, so both
+// run at the same speed, the fixed form only helps where alloc isn't inlined
+static void BM_typed_alloc_fixed(benchmark::State &s) {
+	cau::generic_allocator<cau::default_allocator> alloc;
+	Record                                        *records[64];
+	for (auto _: s) {
+		for (auto &record: records) {
+			record = alloc.alloc<Record, 1>();
+			benchmark::DoNotOptimize(record);
+		}
+		for (auto *record: records) { alloc.dealloc<Record, 1>(record); }
+	}
+	s.SetItemsProcessed(int64_t(s.iterations()) * 64);
+}
+
+/*
+ * s.range(0) processes allocate and free from the same shared heap at the same time.
+ */
+static void BM_shared_heap_processes(benchmark::State &s) {
+	constexpr uint64_t OPERATIONS = 20'000;
+	const std::string  name       = "/cau_bench_" + std::to_string(getpid());
+	auto               heap       = cau::shared_heap<>::create(name.c_str(), 64 * 1024 * 1024);
+
+	for (auto _: s) {
+		for (int64_t p = 0; p < s.range(0); p++) {
+			if (fork() != 0) { continue; }
+			cau::allocation live[16]{};
+			for (uint64_t i = 0; i < OPERATIONS; i++) {
+				cau::allocation &slot = live[i % 16];
+				if (slot.begin != nullptr) { heap.dealloc(slot); }
+				slot = heap.alloc(16 + (i * 37) % 512);
+			}
+			for (auto &slot: live) { heap.dealloc(slot); }
+			_exit(0);
+		}
+		for (int64_t p = 0; p < s.range(0); p++) { wait(nullptr); }
+	}
+	cau::shared_heap<>::unlink(name.c_str());
+	s.SetItemsProcessed(int64_t(s.iterations()) * s.range(0) * OPERATIONS);
+}
+
 BENCHMARK(BM_custom_allocator)->UseRealTime();
 BENCHMARK(BM_std_allocator)->UseRealTime();
+BENCHMARK(BM_typed_alloc_runtime);
+BENCHMARK(BM_typed_alloc_fixed);
+BENCHMARK(BM_shared_heap_processes)->Arg(1)->Arg(2)->Arg(4)->UseRealTime();
 
 BENCHMARK_MAIN();
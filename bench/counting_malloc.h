@@ -0,0 +1,29 @@
+#ifndef CUSTOM_ALLOCATOR_COUNTING_MALLOC_H
+#define CUSTOM_ALLOCATOR_COUNTING_MALLOC_H
+
+#include "include/utils.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <malloc.h>
+
+// memory held from malloc, including the overhead malloc reports for each block
+inline uint64_t footprint      = 0;
+inline uint64_t peak_footprint = 0;
+
+/*
+ * malloc as the wrapped allocator, keeping track of the memory it holds.
+ */
+constexpr cau::i_allocator counting_malloc = {[](size_t size) -> cau::allocation {
+												  auto *ptr = (uint8_t *) malloc(size);
+												  footprint += malloc_usable_size(ptr);
+												  peak_footprint = std::max(peak_footprint, footprint);
+												  return {ptr, ptr + size};
+											  },
+											  [](cau::allocation alloc) {
+												  footprint -= malloc_usable_size(alloc.begin);
+												  free(alloc.begin);
+											  }};
+
+#endif //CUSTOM_ALLOCATOR_COUNTING_MALLOC_H
@@ -0,0 +1,139 @@
+//
+// Replays an allocation trace recorded with cau::trace_recorder against several allocators.
+// Usage: replay [trace file]
+// Without a trace file, a synthetic trace is recorded first.
+//
+
+#include "bench/counting_malloc.h"
+#include "include/generic_unsync_alloc.h"
+#include "include/trace_recorder.h"
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <vector>
+
+
+cau::generic_allocator<cau::default_allocator> *cau::global_file_allocator;
+
+/*
+ * Adapter to replay directly against an i_allocator, i.e. without any wrapping allocator.
+ */
+template<cau::i_allocator allocator>
+struct raw_allocator {
+	cau::allocation alloc(size_t size) { return allocator.alloc(size); }
+	void            dealloc(cau::allocation alloc) { allocator.dealloc(alloc); }
+};
+
+struct replay_result {
+	uint64_t operations;
+	double   seconds;
+	uint64_t latency_percentiles[4]; // p50, p99, p99.9, max in ns
+	uint64_t peak_footprint;
+};
+
+template<class Allocator>
+replay_result replay(const std::vector<cau::trace_event> &events) {
+	footprint      = 0;
+	peak_footprint = 0;
+
+	std::vector<cau::allocation> allocations;
+	std::vector<uint32_t>        latencies;
+	latencies.reserve(events.size());
+
+	auto       allocator = std::make_unique<Allocator>();
+	const auto begin     = std::chrono::steady_clock::now();
+	for (const cau::trace_event &event: events) {
+		const auto op_begin = std::chrono::steady_clock::now();
+		if (event.kind == cau::trace_event::KIND::ALLOC) {
+			cau::allocation a = allocator->alloc(event.size);
+			// touch the memory, like the traced program would
+			if (event.size > 0) { *a.begin = 1; }
+			allocations.push_back(a);
+		} else {
+			allocator->dealloc(allocations[event.id]);
+			allocations[event.id] = {nullptr, nullptr};
+		}
+		latencies.push_back(uint32_t((std::chrono::steady_clock::now() - op_begin).count()));
+	}
+	const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+	// allocations leaked by the traced program
+	for (cau::allocation a: allocations) {
+		if (a.begin != nullptr) { allocator->dealloc(a); }
+	}
+	allocator.reset();
+
+	replay_result result{events.size(), seconds, {}, peak_footprint};
+	std::sort(latencies.begin(), latencies.end());
+	const double quantiles[] = {0.5, 0.99, 0.999, 1.0};
+	for (uint64_t i = 0; i < 4 && !latencies.empty(); i++) {
+		result.latency_percentiles[i] = latencies[std::min<uint64_t>(latencies.size() - 1,
+																	 uint64_t(quantiles[i] * latencies.size()))];
+	}
+	return result;
+}
+
+/*
+ * Mix of many small short-lived allocations, some long-lived ones and rare large ones.
+ */
+std::string record_synthetic_trace() {
+	std::stringstream                              trace;
+	cau::generic_allocator<cau::default_allocator> alloc;
+	{
+		cau::trace_recorder          recorder(alloc, trace);
+		std::mt19937_64              rng(42);
+		std::vector<cau::allocation> live;
+		for (uint64_t i = 0; i < 1'000'000; i++) {
+			const uint64_t kind = rng() % 100;
+			uint64_t       size = 8 + rng() % 248;
+			if (kind >= 70) { size = 256 + rng() % 8000; }
+			if (kind >= 98) { size = 32'000 + rng() % 200'000; }
+			live.push_back(recorder.alloc(size));
+			// most allocations die young, the others at a random point
+			while (!live.empty() && rng() % 100 < 48) {
+				const uint64_t index = rng() % 4 == 0 ? rng() % live.size() : live.size() - 1;
+				recorder.dealloc(live[index]);
+				live[index] = live.back();
+				live.pop_back();
+			}
+		}
+		for (cau::allocation a: live) { recorder.dealloc(a); }
+	}
+	return trace.str();
+}
+
+void print_result(const char *trace_name, const char *allocator_name, const replay_result &result) {
+	std::cout << trace_name << ',' << allocator_name << ',' << result.operations << ',' << result.seconds << ','
+			  << uint64_t(double(result.operations) / result.seconds) << ',' << result.latency_percentiles[0] << ','
+			  << result.latency_percentiles[1] << ',' << result.latency_percentiles[2] << ','
+			  << result.latency_percentiles[3] << ',' << result.peak_footprint << std::endl;
+}
+
+int main(int argc, char **argv) {
+	std::vector<cau::trace_event> events;
+	const char                   *trace_name = "synthetic";
+	if (argc > 1) {
+		trace_name = argv[1];
+		std::ifstream file(argv[1], std::ios::binary);
+		if (!file) {
+			std::cerr << "Can't open " << argv[1] << std::endl;
+			return 1;
+		}
+		events = cau::read_trace(file);
+	} else {
+		std::stringstream trace(record_synthetic_trace());
+		events = cau::read_trace(trace);
+	}
+
+	std::cout << "trace,allocator,operations,seconds,operations_per_second,p50_ns,p99_ns,p999_ns,max_ns,"
+				 "peak_footprint_bytes"
+			  << std::endl;
+	print_result(trace_name, "generic_allocator", replay<cau::generic_allocator<counting_malloc>>(events));
+	print_result(trace_name, "malloc", replay<raw_allocator<counting_malloc>>(events));
+	return 0;
+}
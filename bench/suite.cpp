@@ -0,0 +1,530 @@
+//
+// Benchmark suite comparing generic_allocator with malloc over several workloads.
+// Usage: suite [workload], runs only the workload of that exact name, e.g. containers_10000, or all without one.
+// Every workload runs in a forked process, so peak RSS is measured per run. The results are printed as CSV.
+// Latencies are per allocator call, in buckets of 1/8 of a power of two, the percentiles are the upper bounds.
+// generic_allocator isn't thread safe, so it's guarded by a lock when several threads share it.
+// The memory reserved by malloc is sampled with mallinfo2, the one of generic_allocator is counted exactly. Both peaks
+// are taken relative to the memory reserved when the workload starts.
+//
+
+#include "bench/counting_malloc.h"
+#include "include/bucket_maintainer.h"
+#include "include/generic_unsync_alloc.h"
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cmath>
+#include <functional>
+#include <initializer_list>
+#include <iostream>
+#include <list>
+#include <malloc.h>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+
+cau::generic_allocator<cau::default_allocator> *cau::global_file_allocator;
+
+using bench_clock = std::chrono::steady_clock;
+
+struct latency_histogram {
+	// values below 16 ns get their own bucket, the others 8 buckets per power of two
+	static constexpr uint64_t BUCKETS = 8 * 64;
+
+	uint64_t counts[BUCKETS] = {};
+	uint64_t max             = 0;
+
+	static uint64_t index_of(uint64_t ns) {
+		if (ns < 16) { return ns; }
+		const uint64_t shift = std::bit_width(ns) - 4;
+		return shift * 8 + (ns >> shift);
+	}
+
+	static uint64_t upper_bound_of(uint64_t index) {
+		if (index < 16) { return index; }
+		const uint64_t shift = index / 8 - 1;
+		return ((index % 8 + 9) << shift) - 1;
+	}
+
+	void record(uint64_t ns) {
+		counts[index_of(ns)]++;
+		max = std::max(max, ns);
+	}
+
+	void merge(const latency_histogram &other) {
+		for (uint64_t i = 0; i < BUCKETS; i++) { counts[i] += other.counts[i]; }
+		max = std::max(max, other.max);
+	}
+
+	[[nodiscard]] uint64_t percentile(double quantile) const {
+		uint64_t total = 0;
+		for (uint64_t count: counts) { total += count; }
+		const auto target = uint64_t(std::ceil(quantile * double(total)));
+		uint64_t   seen   = 0;
+		for (uint64_t i = 0; i < BUCKETS; i++) {
+			seen += counts[i];
+			if (seen >= target && seen != 0) { return std::min(upper_bound_of(i), max); }
+		}
+		return max;
+	}
+};
+
+// bytes handed out by the allocator, shared by all threads of a workload
+struct byte_counter {
+	std::atomic<int64_t> live{0};
+	std::atomic<int64_t> peak{0};
+
+	void add(int64_t bytes) {
+		const int64_t now  = live.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+		int64_t       seen = peak.load(std::memory_order_relaxed);
+		while (now > seen && !peak.compare_exchange_weak(seen, now, std::memory_order_relaxed)) {}
+	}
+};
+
+struct malloc_backend {
+	static constexpr const char *name        = "malloc";
+	static constexpr bool        thread_safe = true;
+
+	uint64_t              baseline = 0;
+	std::atomic<uint64_t> peak{0};
+
+	void *alloc(size_t size) { return malloc(size); }
+
+	void dealloc(void *ptr, size_t) { free(ptr); }
+
+	static uint64_t reserved() {
+		const struct mallinfo2 info = mallinfo2();
+		return info.arena + info.hblkhd;
+	}
+
+	void start() {
+		baseline = reserved();
+		peak     = baseline;
+	}
+
+	void sample() {
+		const uint64_t now  = reserved();
+		uint64_t       seen = peak.load(std::memory_order_relaxed);
+		while (now > seen && !peak.compare_exchange_weak(seen, now, std::memory_order_relaxed)) {}
+	}
+
+	uint64_t peak_bytes_reserved() {
+		sample();
+		return peak - baseline;
+	}
+};
+
+struct cau_backend {
+	static constexpr const char *name        = "generic_allocator";
+	static constexpr bool        thread_safe = false;
+
+	cau::generic_allocator<counting_malloc> heap;
+	uint64_t                                baseline = 0;
+
+	void *alloc(size_t size) { return heap.alloc(size).begin; }
+
+	void dealloc(void *ptr, size_t size) { heap.dealloc({(uint8_t *) ptr, (uint8_t *) ptr + size}); }
+
+	void start() {
+		baseline       = footprint;
+		peak_footprint = footprint;
+	}
+
+	void sample() {}
+
+	uint64_t peak_bytes_reserved() { return peak_footprint - baseline; }
+};
+
+/*
+ * Serializes all calls into a backend, that isn't thread safe.
+ */
+template<class Backend>
+struct locked {
+	static constexpr const char *name = Backend::name;
+
+	Backend   &backend;
+	std::mutex mutex;
+
+	void *alloc(size_t size) {
+		std::lock_guard<std::mutex> lock(mutex);
+		return backend.alloc(size);
+	}
+
+	void dealloc(void *ptr, size_t size) {
+		std::lock_guard<std::mutex> lock(mutex);
+		backend.dealloc(ptr, size);
+	}
+
+	void start() {
+		std::lock_guard<std::mutex> lock(mutex);
+		backend.start();
+	}
+
+	void sample() {
+		std::lock_guard<std::mutex> lock(mutex);
+		backend.sample();
+	}
+
+	uint64_t peak_bytes_reserved() {
+		std::lock_guard<std::mutex> lock(mutex);
+		return backend.peak_bytes_reserved();
+	}
+};
+
+/*
+ * Times every call into the backend. One recorder per thread.
+ */
+template<class Backend>
+struct recorder {
+	Backend          &backend;
+	byte_counter     &requested;
+	latency_histogram latencies{};
+	uint64_t          operations = 0;
+
+	void *alloc(size_t size) {
+		const auto begin = bench_clock::now();
+		void      *ptr   = backend.alloc(size);
+		latencies.record((bench_clock::now() - begin).count());
+		// touch the memory, like a real program would
+		*(volatile char *) ptr = 1;
+		requested.add(int64_t(size));
+		count();
+		return ptr;
+	}
+
+	void dealloc(void *ptr, size_t size) {
+		const auto begin = bench_clock::now();
+		backend.dealloc(ptr, size);
+		latencies.record((bench_clock::now() - begin).count());
+		requested.add(-int64_t(size));
+		count();
+	}
+
+	void count() {
+		if ((++operations & 0xffff) == 0) { backend.sample(); }
+	}
+};
+
+/*
+ * STL allocator, that goes through a recorder.
+ */
+template<class T, class Backend>
+struct stl_allocator {
+	using value_type = T;
+
+	recorder<Backend> *rec;
+
+	explicit stl_allocator(recorder<Backend> *rec) : rec(rec) {}
+
+	template<class U>
+	stl_allocator(const stl_allocator<U, Backend> &other) : rec(other.rec) {}
+
+	T *allocate(size_t n) { return (T *) rec->alloc(n * sizeof(T)); }
+
+	void deallocate(T *ptr, size_t n) { rec->dealloc(ptr, n * sizeof(T)); }
+
+	bool operator==(const stl_allocator &other) const { return rec == other.rec; }
+};
+
+struct result {
+	uint64_t operations;
+	double   seconds;
+	uint64_t latency_percentiles[4]; // p50, p99, p99.9, max in ns
+	uint64_t peak_bytes_requested;
+	uint64_t peak_bytes_reserved;
+	long     peak_rss_kb;
+};
+
+template<class Backend>
+struct session {
+	Backend                &backend;
+	byte_counter            requested;
+	bench_clock::time_point begin;
+
+	explicit session(Backend &backend) : backend(backend) {
+		backend.start();
+		begin = bench_clock::now();
+	}
+
+	recorder<Backend> make_recorder() { return {backend, requested}; }
+
+	result finish(std::initializer_list<const recorder<Backend> *> recorders) {
+		const double      seconds = std::chrono::duration<double>(bench_clock::now() - begin).count();
+		latency_histogram latencies;
+		uint64_t          operations = 0;
+		for (const auto *rec: recorders) {
+			latencies.merge(rec->latencies);
+			operations += rec->operations;
+		}
+		return {operations,
+				seconds,
+				{latencies.percentile(0.5), latencies.percentile(0.99), latencies.percentile(0.999), latencies.max},
+				uint64_t(requested.peak.load()),
+				backend.peak_bytes_reserved(),
+				0};
+	}
+};
+
+/*
+ * Same size over and over, the live set stays constant.
+ */
+template<class Backend>
+result fixed_churn(Backend &backend) {
+	constexpr uint64_t LIVE = 10'000;
+	constexpr uint64_t SIZE = 64;
+
+	std::vector<void *> live(LIVE);
+
+	session s(backend);
+	auto    rec = s.make_recorder();
+	for (auto &ptr: live) { ptr = rec.alloc(SIZE); }
+	for (uint64_t i = 0; i < 2'000'000; i++) {
+		rec.dealloc(live[i % LIVE], SIZE);
+		live[i % LIVE] = rec.alloc(SIZE);
+	}
+	for (void *ptr: live) { rec.dealloc(ptr, SIZE); }
+	return s.finish({&rec});
+}
+
+/*
+ * Sizes from a Pareto distribution, most allocations are tiny, a few are huge.
+ */
+template<class Backend>
+result power_law(Backend &backend) {
+	constexpr uint64_t LIVE = 20'000;
+
+	std::vector<std::pair<void *, uint64_t>> live(LIVE);
+	std::mt19937_64                          rng(42);
+	std::uniform_real_distribution<double>   uniform(0.0, 1.0);
+	auto next_size = [&] { return uint64_t(std::min(16.0 / std::pow(1.0 - uniform(rng), 1.0 / 1.1), 1'000'000.0)); };
+
+	session s(backend);
+	auto    rec = s.make_recorder();
+	for (auto &[ptr, size]: live) {
+		size = next_size();
+		ptr  = rec.alloc(size);
+	}
+	for (uint64_t i = 0; i < 1'000'000; i++) {
+		auto &[ptr, size] = live[rng() % LIVE];
+		rec.dealloc(ptr, size);
+		size = next_size();
+		ptr  = rec.alloc(size);
+	}
+	for (auto [ptr, size]: live) { rec.dealloc(ptr, size); }
+	return s.finish({&rec});
+}
+
+/*
+ * One thread allocates messages, another one frees them.
+ */
+template<class Backend>
+result producer_consumer_on(Backend &backend) {
+	constexpr uint64_t MESSAGES = 1'000'000;
+
+	cau::spsc_ring<1024> queue;
+	std::mt19937_64      rng(42);
+
+	session     s(backend);
+	auto        producer = s.make_recorder();
+	auto        consumer = s.make_recorder();
+	std::thread consumer_thread([&] {
+		for (uint64_t received = 0; received < MESSAGES;) {
+			if (auto message = queue.pop()) {
+				consumer.dealloc(message->begin, message->end - message->begin);
+				received++;
+			} else {
+				std::this_thread::yield();
+			}
+		}
+	});
+	for (uint64_t i = 0; i < MESSAGES; i++) {
+		const uint64_t size = 16 + rng() % 1000;
+		auto          *ptr  = (uint8_t *) producer.alloc(size);
+		while (!queue.push({ptr, ptr + size})) { std::this_thread::yield(); }
+	}
+	consumer_thread.join();
+	return s.finish({&producer, &consumer});
+}
+
+template<class Backend>
+result producer_consumer(Backend &backend) {
+	if constexpr (Backend::thread_safe) {
+		return producer_consumer_on(backend);
+	} else {
+		locked<Backend> guarded{backend, {}};
+		return producer_consumer_on(guarded);
+	}
+}
+
+/*
+ * Rounds of short-lived allocations, each leaving a few long-lived ones behind.
+ */
+template<class Backend>
+result fragmentation(Backend &backend) {
+	constexpr uint64_t ROUNDS    = 20;
+	constexpr uint64_t PER_ROUND = 100'000;
+
+	std::vector<std::pair<void *, uint64_t>> round;
+	std::vector<std::pair<void *, uint64_t>> long_lived;
+	round.reserve(PER_ROUND);
+	long_lived.reserve(ROUNDS * PER_ROUND / 10 + ROUNDS);
+
+	session         s(backend);
+	auto            rec = s.make_recorder();
+	std::mt19937_64 rng(42);
+	for (uint64_t r = 0; r < ROUNDS; r++) {
+		round.clear();
+		for (uint64_t i = 0; i < PER_ROUND; i++) {
+			const uint64_t size = 16 + rng() % 2032;
+			round.emplace_back(rec.alloc(size), size);
+		}
+		for (auto [ptr, size]: round) {
+			if (rng() % 10 == 0) {
+				long_lived.emplace_back(ptr, size);
+			} else {
+				rec.dealloc(ptr, size);
+			}
+		}
+		backend.sample();
+	}
+	for (auto [ptr, size]: long_lived) { rec.dealloc(ptr, size); }
+	return s.finish({&rec});
+}
+
+/*
+ * Mostly allocations above the large allocation threshold.
+ */
+template<class Backend>
+result large_heavy(Backend &backend) {
+	constexpr uint64_t LIVE = 64;
+
+	std::vector<std::pair<void *, uint64_t>> live(LIVE);
+	std::mt19937_64                          rng(42);
+
+	session s(backend);
+	auto    rec = s.make_recorder();
+	for (auto &[ptr, size]: live) {
+		size = 32'000 + rng() % 4'000'000;
+		ptr  = rec.alloc(size);
+	}
+	for (uint64_t i = 0; i < 200'000; i++) {
+		auto &[ptr, size] = live[rng() % LIVE];
+		rec.dealloc(ptr, size);
+		size = rng() % 8 == 0 ? 16 + rng() % 1000 : 32'000 + rng() % 4'000'000;
+		ptr  = rec.alloc(size);
+	}
+	for (auto [ptr, size]: live) { rec.dealloc(ptr, size); }
+	return s.finish({&rec});
+}
+
+/*
+ * Builds and tears down a vector, a list and a hash map of elements each.
+ */
+template<class Backend>
+result containers(Backend &backend, uint64_t elements) {
+	session s(backend);
+	auto    rec = s.make_recorder();
+	{
+		std::vector<uint64_t, stl_allocator<uint64_t, Backend>> vector{stl_allocator<uint64_t, Backend>(&rec)};
+		std::list<uint64_t, stl_allocator<uint64_t, Backend>>   list{stl_allocator<uint64_t, Backend>(&rec)};
+		std::unordered_map<uint64_t, uint64_t, std::hash<uint64_t>, std::equal_to<>,
+						   stl_allocator<std::pair<const uint64_t, uint64_t>, Backend>>
+				map{stl_allocator<std::pair<const uint64_t, uint64_t>, Backend>(&rec)};
+		for (uint64_t i = 0; i < elements; i++) {
+			vector.push_back(i);
+			list.push_back(i);
+			map.emplace(i, i);
+		}
+		backend.sample();
+	}
+	return s.finish({&rec});
+}
+
+/*
+ * Runs the workload in a child process, to measure its peak RSS on its own.
+ */
+template<class Backend>
+result run_isolated(const std::function<result(Backend &)> &workload) {
+	int fds[2];
+	if (pipe(fds) != 0) { throw std::runtime_error("pipe failed"); }
+	const pid_t pid = fork();
+	if (pid == 0) {
+		close(fds[0]);
+		auto         backend = std::make_unique<Backend>();
+		const result r       = workload(*backend);
+		_exit(write(fds[1], &r, sizeof(r)) == ssize_t(sizeof(r)) ? 0 : 1);
+	}
+	close(fds[1]);
+	result        r{};
+	const ssize_t received = read(fds[0], &r, sizeof(r));
+	close(fds[0]);
+
+	int           status = 0;
+	struct rusage usage {};
+	wait4(pid, &status, 0, &usage);
+	if (received != ssize_t(sizeof(r)) || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		throw std::runtime_error("Workload failed");
+	}
+	r.peak_rss_kb = usage.ru_maxrss;
+	return r;
+}
+
+void print_result(const std::string &workload, const char *allocator_name, const result &r) {
+	std::cout << workload << ',' << allocator_name << ',' << r.operations << ',' << r.seconds << ','
+			  << uint64_t(double(r.operations) / r.seconds) << ',' << r.latency_percentiles[0] << ','
+			  << r.latency_percentiles[1] << ',' << r.latency_percentiles[2] << ',' << r.latency_percentiles[3] << ','
+			  << r.peak_rss_kb << ',' << r.peak_bytes_requested << ',' << r.peak_bytes_reserved << ','
+			  << (r.peak_bytes_requested == 0 ? 0.0 : double(r.peak_bytes_reserved) / double(r.peak_bytes_requested))
+			  << std::endl;
+}
+
+struct workload {
+	std::string                             name;
+	std::function<result(cau_backend &)>    on_cau;
+	std::function<result(malloc_backend &)> on_malloc;
+};
+
+/*
+ * run is called with the backend, so it must be a generic lambda.
+ */
+template<class F>
+workload make_workload(std::string name, F run) {
+	return {std::move(name), run, run};
+}
+
+int main(int argc, char **argv) {
+	const std::string only = argc > 1 ? argv[1] : "";
+
+	std::vector<workload> workloads = {
+			make_workload("fixed_churn", [](auto &backend) { return fixed_churn(backend); }),
+			make_workload("power_law", [](auto &backend) { return power_law(backend); }),
+			make_workload("producer_consumer", [](auto &backend) { return producer_consumer(backend); }),
+			make_workload("fragmentation", [](auto &backend) { return fragmentation(backend); }),
+			make_workload("large_heavy", [](auto &backend) { return large_heavy(backend); }),
+	};
+	for (uint64_t elements: {1'000, 10'000, 100'000, 1'000'000, 10'000'000}) {
+		workloads.push_back(make_workload("containers_" + std::to_string(elements),
+										  [elements](auto &backend) { return containers(backend, elements); }));
+	}
+
+	std::cout << "workload,allocator,operations,seconds,operations_per_second,p50_ns,p99_ns,p999_ns,max_ns,"
+				 "peak_rss_kb,peak_bytes_requested,peak_bytes_reserved,reserved_per_requested"
+			  << std::endl;
+	for (const workload &w: workloads) {
+		if (!only.empty() && w.name != only) { continue; }
+		print_result(w.name, cau_backend::name, run_isolated(w.on_cau));
+		print_result(w.name, malloc_backend::name, run_isolated(w.on_malloc));
+	}
+	return 0;
+}
@@ -0,0 +1,107 @@
+#ifndef CUSTOM_ALLOCATOR_ALLOCATOR_STATS_H
+#define CUSTOM_ALLOCATOR_ALLOCATOR_STATS_H
+
+#include "utils.h"
+
+#include <bit>
+#include <cstdint>
+#include <type_traits>
+
+namespace cau {
+	/**
+	 * Snapshot of the counters of an allocator compiled with STATISTICS::COUNTERS.
+	 * The layout is plain data, so it can be copied out and exported as is.
+	 * Small allocations are grouped into power of two size classes in units of 64 bytes,
+	 * class 0 holds everything up to 64 bytes, class 9 everything up to LARGE_ALLOCATION_THRESHOLD.
+	 * The last class counts large allocations.
+	 */
+	struct allocator_stats {
+		static constexpr uint64_t LARGE_SIZE_CLASS = 10;
+		static constexpr uint64_t SIZE_CLASS_COUNT = LARGE_SIZE_CLASS + 1;
+
+		uint64_t allocations[SIZE_CLASS_COUNT]   = {};
+		uint64_t deallocations[SIZE_CLASS_COUNT] = {};
+
+		uint64_t bucket_searches = 0; // calls into the small allocator
+		uint64_t bucket_scans    = 0; // buckets looked at by these calls
+
+		uint64_t buckets_created   = 0;
+		uint64_t buckets_destroyed = 0;
+		uint64_t nodes_created     = 0;
+		uint64_t nodes_destroyed   = 0;
+
+		uint64_t large_bytes = 0; // currently allocated through the large path
+
+		// usable bytes handed out to the user, the requested sizes rounded up to the 64 byte granularity
+		uint64_t bytes_handed_out    = 0;
+		uint64_t bytes_reserved      = 0; // currently held from the wrapped allocator
+		uint64_t peak_bytes_reserved = 0;
+
+		static constexpr uint64_t size_class(uint64_t size) {
+			if (size > LARGE_ALLOCATION_THRESHOLD) { return LARGE_SIZE_CLASS; }
+			const uint64_t slots = (size + 63) / 64;
+			return slots <= 1 ? 0 : std::bit_width(slots - 1);
+		}
+
+		void reserve(uint64_t bytes) {
+			bytes_reserved += bytes;
+			if (bytes_reserved > peak_bytes_reserved) { peak_bytes_reserved = bytes_reserved; }
+		}
+
+		void release(uint64_t bytes) { bytes_reserved -= bytes; }
+
+		/*
+		 * Adds the counters of another allocator. The peak becomes the sum of both peaks, an upper bound.
+		 */
+		allocator_stats &operator+=(const allocator_stats &other) {
+			for (uint64_t i = 0; i < SIZE_CLASS_COUNT; i++) {
+				allocations[i] += other.allocations[i];
+				deallocations[i] += other.deallocations[i];
+			}
+			bucket_searches += other.bucket_searches;
+			bucket_scans += other.bucket_scans;
+			buckets_created += other.buckets_created;
+			buckets_destroyed += other.buckets_destroyed;
+			nodes_created += other.nodes_created;
+			nodes_destroyed += other.nodes_destroyed;
+			large_bytes += other.large_bytes;
+			bytes_handed_out += other.bytes_handed_out;
+			bytes_reserved += other.bytes_reserved;
+			peak_bytes_reserved += other.peak_bytes_reserved;
+			return *this;
+		}
+
+		[[nodiscard]] uint64_t total_allocations() const {
+			uint64_t total = 0;
+			for (uint64_t count: allocations) { total += count; }
+			return total;
+		}
+
+		[[nodiscard]] uint64_t total_deallocations() const {
+			uint64_t total = 0;
+			for (uint64_t count: deallocations) { total += count; }
+			return total;
+		}
+
+		[[nodiscard]] double bucket_scans_per_allocation() const {
+			return bucket_searches == 0 ? 0.0 : double(bucket_scans) / double(bucket_searches);
+		}
+
+		/*
+		 * Share of the reserved memory, that isn't handed out to the user.
+		 * This includes headers, free slots in buckets and the bookkeeping nodes.
+		 */
+		[[nodiscard]] double fragmentation() const {
+			if (bytes_reserved == 0 || bytes_handed_out > bytes_reserved) { return 0.0; }
+			return 1.0 - double(bytes_handed_out) / double(bytes_reserved);
+		}
+	};
+
+	// Stand-in for allocator_stats, if the counters are compiled out.
+	struct no_stats {};
+
+	template<STATISTICS ST>
+	using stats_storage = std::conditional_t<ST == STATISTICS::COUNTERS, allocator_stats, no_stats>;
+} // namespace cau
+
+#endif //CUSTOM_ALLOCATOR_ALLOCATOR_STATS_H
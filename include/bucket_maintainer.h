@@ -0,0 +1,56 @@
+#ifndef CUSTOM_ALLOCATOR_BUCKET_MAINTAINER_H
+#define CUSTOM_ALLOCATOR_BUCKET_MAINTAINER_H
+
+#include "bucket_reserve.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+namespace cau {
+	/**
+	 * Maintenance thread, that takes the calls into the wrapped allocator off the allocation path of a Small_Allocator.
+	 * It runs bucket_reserve::do_work every interval.
+	 * The allocator still belongs to a single thread, the maintainer only talks to it through two lock free queues.
+	 * The wrapped allocator must be callable from the maintenance thread.
+	 * Attach it with Small_Allocator::set_maintainer, the maintainer must outlive the allocator.
+	 */
+	struct bucket_maintainer : bucket_reserve {
+		std::chrono::microseconds interval;
+
+		std::mutex              mutex;
+		std::condition_variable wake;
+		bool                    stop = false;
+		std::thread             worker;
+
+		bucket_maintainer(i_allocator allocator, uint64_t bucket_size, uint64_t reserve_target = 8,
+						  std::chrono::microseconds interval = std::chrono::milliseconds(1))
+			: bucket_reserve(allocator, bucket_size, reserve_target), interval(interval) {
+			do_work();
+			worker = std::thread([this] { run(); });
+		}
+
+		// the queues are drained by ~bucket_reserve, once the thread is gone
+		~bucket_maintainer() {
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				stop = true;
+			}
+			wake.notify_one();
+			worker.join();
+		}
+
+		void run() {
+			std::unique_lock<std::mutex> lock(mutex);
+			while (!stop) {
+				lock.unlock();
+				do_work();
+				lock.lock();
+				wake.wait_for(lock, interval, [this] { return stop; });
+			}
+		}
+	};
+} // namespace cau
+
+#endif //CUSTOM_ALLOCATOR_BUCKET_MAINTAINER_H
@@ -0,0 +1,121 @@
+#ifndef CUSTOM_ALLOCATOR_BUCKET_RESERVE_H
+#define CUSTOM_ALLOCATOR_BUCKET_RESERVE_H
+
+#include "utils.h"
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+
+namespace cau {
+	/**
+	 * Lock free queue for exactly one producer and one consumer thread.
+	 */
+	template<uint64_t CAPACITY>
+	struct spsc_ring {
+		alignas(64) std::atomic<uint64_t> head{0}; // next to pop, written by the consumer
+		alignas(64) std::atomic<uint64_t> tail{0}; // next to push, written by the producer
+		allocation slots[CAPACITY]{};
+
+		bool push(allocation alloc) {
+			const uint64_t t = tail.load(std::memory_order_relaxed);
+			if (t - head.load(std::memory_order_acquire) == CAPACITY) { return false; }
+			slots[t % CAPACITY] = alloc;
+			tail.store(t + 1, std::memory_order_release);
+			return true;
+		}
+
+		std::optional<allocation> pop() {
+			const uint64_t h = head.load(std::memory_order_relaxed);
+			if (h == tail.load(std::memory_order_acquire)) { return std::nullopt; }
+			allocation alloc = slots[h % CAPACITY];
+			head.store(h + 1, std::memory_order_release);
+			return alloc;
+		}
+
+		[[nodiscard]] uint64_t size() const {
+			return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire);
+		}
+	};
+
+	/**
+	 * Queues between a Small_Allocator and the thread refilling them, the thread itself is in bucket_maintainer.h.
+	 * Retired buckets and nodes are queued and returned to the wrapped allocator by do_work.
+	 * A reserve of zeroed buckets of bucket_size bytes is kept ready, so constructing a bucket doesn't need to
+	 * allocate or memset, if the requested bucket fits.
+	 * The reserve holds a single size only. Small_Allocator::bucket_allocation_size is the same for every allocation
+	 * up to about 2.6 KB with the default alignment, so bucket_allocation_size(0) covers all of them.
+	 * Buckets for larger allocations always come from the wrapped allocator and count as reserve_misses.
+	 */
+	struct bucket_reserve {
+		static constexpr uint64_t RETIRED_CAPACITY = 256;
+		static constexpr uint64_t RESERVE_CAPACITY = 64;
+
+		i_allocator allocator;
+		uint64_t    bucket_size;
+		uint64_t    reserve_target;
+
+		spsc_ring<RETIRED_CAPACITY> retired;
+		spsc_ring<RESERVE_CAPACITY> reserve;
+
+		// only touched by the allocating thread
+		uint64_t buckets_taken    = 0;
+		uint64_t reserve_misses   = 0;
+		uint64_t retired_directly = 0;
+
+		bucket_reserve(i_allocator allocator, uint64_t bucket_size, uint64_t reserve_target)
+			: allocator(allocator), bucket_size(bucket_size),
+			  reserve_target(reserve_target < RESERVE_CAPACITY ? reserve_target : RESERVE_CAPACITY) {}
+
+		bucket_reserve(const bucket_reserve &) = delete;
+
+		~bucket_reserve() {
+			while (auto alloc = retired.pop()) { allocator.dealloc(*alloc); }
+			while (auto alloc = reserve.pop()) { allocator.dealloc(*alloc); }
+		}
+
+		/*
+		 * Queue memory of the wrapped allocator for deallocation.
+		 * If the queue is full, the memory is deallocated right away.
+		 */
+		void retire(allocation alloc) {
+			if (!retired.push(alloc)) {
+				retired_directly++;
+				allocator.dealloc(alloc);
+			}
+		}
+
+		/*
+		 * Zeroed memory for a bucket of at least minimal_size bytes, if the reserve has one.
+		 */
+		std::optional<allocation> take_bucket(uint64_t minimal_size) {
+			if (minimal_size <= bucket_size) {
+				if (auto alloc = reserve.pop()) {
+					buckets_taken++;
+					return alloc;
+				}
+			}
+			reserve_misses++;
+			return std::nullopt;
+		}
+
+		/*
+		 * Consumer side, only one thread at a time may call it.
+		 */
+		void do_work() {
+			while (auto alloc = retired.pop()) { allocator.dealloc(*alloc); }
+			while (reserve.size() < reserve_target) {
+				allocation alloc = allocator.alloc(bucket_size);
+				if (alloc.begin == nullptr) { return; }
+				memset(alloc.begin, 0, alloc.end - alloc.begin);
+				if (!reserve.push(alloc)) {
+					allocator.dealloc(alloc);
+					return;
+				}
+			}
+		}
+	};
+} // namespace cau
+
+#endif //CUSTOM_ALLOCATOR_BUCKET_RESERVE_H
@@ -0,0 +1,304 @@
+#ifndef CUSTOM_ALLOCATOR_FILE_HEAP_H
+#define CUSTOM_ALLOCATOR_FILE_HEAP_H
+
+#include "generic_unsync_alloc.h"
+#include "small_allocation_bucket.h"
+#include "utils.h"
+
+#include <cstdint>
+#include <fcntl.h>
+#include <initializer_list>
+#include <linux/fs.h>
+#include <new>
+#include <stdexcept>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <unordered_set>
+
+namespace cau {
+	constexpr uint64_t FILE_HEAP_PAGE_SIZE = 4096;
+
+	/*
+	 * First page of the file. The file is always mapped at address, so pointers stored inside stay valid.
+	 */
+	struct file_heap_header {
+		static constexpr uint64_t MAGIC_NUMBER = 0x50414548454c4946;
+
+		uint64_t                         magic_number; // set last, once the header is initialized
+		uint64_t                         size;
+		uint64_t                         address;
+		uint64_t                         heap_size; // sizeof the allocator, rejects files of another configuration
+		sab::bucket<FILE_HEAP_PAGE_SIZE> pages;     // rest of the file, one bit per page
+		void                            *heap;
+		void                            *root; // object chosen by the user, nullptr if there is none
+	};
+
+	// The wrapped allocator has no state, it takes the pages from the file heap activated last.
+	// Like any other wrapped allocator, it returns {nullptr, nullptr}, once the file is full.
+	inline file_heap_header *active_file_heap = nullptr;
+
+	constexpr i_allocator file_page_allocator = {[](size_t size) -> allocation {
+													 auto alloc = active_file_heap->pages.try_alloc(size);
+													 if (!alloc) { return {nullptr, nullptr}; }
+													 return *alloc;
+												 },
+												 [](allocation alloc) {
+													 active_file_heap->pages.dealloc(
+															 {alloc.begin, (uint8_t *) round_up_to_multiple(
+																				   uint64_t(alloc.end), FILE_HEAP_PAGE_SIZE)});
+												 }};
+
+	/**
+	 * generic_allocator living in a memory mapped file, so the heap outlives the process.
+	 * The file is mapped at the same address every time, two heaps created at the same address can't be open at once.
+	 * checkpoint writes back only the buckets, that allocated or freed since the last checkpoint, the large allocations
+	 * made since then and the metadata that changed. Writes to an existing allocation must be reported with mark_dirty.
+	 * snapshot clones the file after a checkpoint, sharing the blocks on file systems with reflinks.
+	 * Readers open a snapshot with MODE::PRIVATE, their writes stay in their process.
+	 * Like generic_allocator, the heap is not thread safe.
+	 * @tparam IC invariant checking level, refer to generic_allocator
+	 */
+	template<INVARIANT_CHECKING IC = INVARIANT_CHECKING::NONE>
+	struct file_heap {
+		using heap_t = generic_allocator<file_page_allocator, IC, STATISTICS::NONE, DIRTY_TRACKING::BUCKETS>;
+
+		static constexpr uint64_t DEFAULT_ADDRESS = 0x5a0000000000;
+
+		enum class MODE { SHARED, PRIVATE };
+
+		int      fd   = -1;
+		uint8_t *base = nullptr;
+		uint64_t size = 0;
+		MODE     mode = MODE::SHARED;
+
+		// large allocations made or marked dirty since the last checkpoint, they have no bucket to carry the flag
+		std::unordered_set<void *> dirty_large;
+
+		file_heap(int fd, uint8_t *base, uint64_t size, MODE mode) : fd(fd), base(base), size(size), mode(mode) {}
+
+		file_heap(const file_heap &) = delete;
+
+		file_heap(file_heap &&other) noexcept
+			: fd(other.fd), base(other.base), size(other.size), mode(other.mode),
+			  dirty_large(std::move(other.dirty_large)) {
+			other.base = nullptr;
+		}
+
+		~file_heap() { close(); }
+
+		/*
+		 * Creates a new file of file_size bytes, fails if path exists already.
+		 */
+		static file_heap create(const char *path, uint64_t file_size, uint64_t address = DEFAULT_ADDRESS) {
+			if (file_size % FILE_HEAP_PAGE_SIZE != 0 || address % FILE_HEAP_PAGE_SIZE != 0) {
+				throw std::runtime_error("Size and address must be multiples of the page size");
+			}
+			int new_fd = ::open(path, O_CREAT | O_EXCL | O_RDWR, 0600);
+			if (new_fd < 0) { throw std::runtime_error("open failed"); }
+			if (ftruncate(new_fd, off_t(file_size)) != 0) {
+				::close(new_fd);
+				::unlink(path);
+				throw std::runtime_error("ftruncate failed");
+			}
+			file_heap heap = map(new_fd, file_size, address, MODE::SHARED);
+
+			file_heap_header *h = new (heap.base) file_heap_header{};
+			h->size             = file_size;
+			h->address          = address;
+			h->heap_size        = sizeof(heap_t);
+			// ftruncate zeroed the file, so the bitmap of the pages is empty already
+			h->pages = sab::bucket<FILE_HEAP_PAGE_SIZE>(heap.base + FILE_HEAP_PAGE_SIZE, heap.base + file_size, nullptr,
+														true);
+			heap.activate();
+			allocation storage = file_page_allocator.alloc(sizeof(heap_t));
+			if (storage.begin == nullptr) {
+				heap.close();
+				::unlink(path);
+				throw std::runtime_error("File is too small for the heap");
+			}
+			h->heap         = new (storage.begin) heap_t{};
+			h->root         = nullptr;
+			h->magic_number = file_heap_header::MAGIC_NUMBER;
+			return heap;
+		}
+
+		/*
+		 * Maps an existing heap or snapshot. MODE::PRIVATE never writes to the file.
+		 */
+		static file_heap open(const char *path, MODE open_mode = MODE::SHARED) {
+			int new_fd = ::open(path, open_mode == MODE::SHARED ? O_RDWR : O_RDONLY);
+			if (new_fd < 0) { throw std::runtime_error("open failed"); }
+			file_heap_header h;
+			if (pread(new_fd, &h, sizeof(h), 0) != ssize_t(sizeof(h)) ||
+				h.magic_number != file_heap_header::MAGIC_NUMBER) {
+				::close(new_fd);
+				throw std::runtime_error("Not a file heap");
+			}
+			if (h.heap_size != sizeof(heap_t)) {
+				::close(new_fd);
+				throw std::runtime_error("File heap was written by another configuration");
+			}
+			file_heap heap = map(new_fd, h.size, h.address, open_mode);
+			heap.activate();
+
+			// the function pointers and attachments of the writing process are gone
+			heap_t *a = heap.heap();
+			for (auto *small: {&a->small_allocator, &a->session_allocator, &a->permanent_allocator}) {
+				new (&small->allocator) i_allocator{file_page_allocator};
+			}
+			a->set_maintainer(nullptr);
+			a->set_profiler(nullptr);
+			return heap;
+		}
+
+		static file_heap map(int fd, uint64_t size, uint64_t address, MODE mode) {
+			void *ptr = mmap((void *) address, size, PROT_READ | PROT_WRITE,
+							 (mode == MODE::SHARED ? MAP_SHARED : MAP_PRIVATE) | MAP_FIXED_NOREPLACE, fd, 0);
+			if (ptr != MAP_FAILED && ptr != (void *) address) {
+				// kernels before 4.17 treat the address as a hint only
+				munmap(ptr, size);
+				ptr = MAP_FAILED;
+			}
+			if (ptr == MAP_FAILED) {
+				::close(fd);
+				throw std::runtime_error("Can't map the file heap at its address");
+			}
+			return file_heap(fd, (uint8_t *) ptr, size, mode);
+		}
+
+		void close() {
+			if (base == nullptr) { return; }
+			if (active_file_heap == header()) { active_file_heap = nullptr; }
+			munmap(base, size);
+			::close(fd);
+			base = nullptr;
+		}
+
+		[[nodiscard]] file_heap_header *header() const { return (file_heap_header *) base; }
+
+		[[nodiscard]] heap_t *heap() const { return (heap_t *) header()->heap; }
+
+		/*
+		 * Route the wrapped allocator to this heap, the allocation functions below do it on their own.
+		 */
+		void activate() const { active_file_heap = header(); }
+
+		allocation alloc(size_t alloc_size) {
+			activate();
+			allocation a = heap()->alloc(alloc_size);
+			if (a.begin != nullptr && is_large_allocation(alloc_size, 64)) { dirty_large.insert(a.begin); }
+			return a;
+		}
+
+		template<class T>
+		T *alloc(size_t count) {
+			return (T *) alloc(sizeof(T) * count).begin;
+		}
+
+		void dealloc(allocation alloc) {
+			activate();
+			dirty_large.erase(alloc.begin);
+			heap()->dealloc(alloc);
+		}
+
+		void dealloc(void *ptr) {
+			activate();
+			dirty_large.erase(ptr);
+			heap()->dealloc(ptr);
+		}
+
+		/*
+		 * Report a write to an allocation made before the last checkpoint.
+		 */
+		void mark_dirty(void *ptr) {
+			if (heap()->large_allocations.contains(ptr)) {
+				dirty_large.insert(ptr);
+				return;
+			}
+			heap()->small_allocator.bucket_of(ptr)->dirty = 1;
+		}
+
+		/*
+		 * Writes the changes since the last checkpoint to the file.
+		 * @return the bytes handed to msync
+		 */
+		uint64_t checkpoint() {
+			if (mode != MODE::SHARED) { throw std::runtime_error("Private mappings can't be written back"); }
+			heap_t  *a       = heap();
+			uint64_t written = 0;
+			for (auto *small: {&a->small_allocator, &a->session_allocator, &a->permanent_allocator}) {
+				for (auto *node = &small->head; node != nullptr; node = node->next) {
+					// the metadata of the buckets lives in the node
+					bool changed = node->dirty;
+					for (auto &bucket: node->buckets) {
+						changed |= bucket.dirty != 0;
+						written += sync_bucket(bucket);
+					}
+					node->dirty = 0;
+					// the heads are written with the allocator below
+					if (changed && node != &small->head) { written += sync(node, node + 1); }
+				}
+			}
+			for (void *ptr: dirty_large) {
+				const allocation alloc = a->large_allocations.at(ptr);
+				written += sync(alloc.begin, alloc.end);
+			}
+			dirty_large.clear();
+
+			file_heap_header *h = header();
+			written += sync(h->pages.begin_of_free_list, h->pages.end_of_free_list);
+			written += sync(a, a + 1);
+			written += sync(h, h + 1);
+			return written;
+		}
+
+		/*
+		 * Checkpoints and clones the file to path, which must not exist.
+		 */
+		void snapshot(const char *path) {
+			checkpoint();
+			int out = ::open(path, O_CREAT | O_EXCL | O_WRONLY, 0600);
+			if (out < 0) { throw std::runtime_error("open failed"); }
+			// shares the blocks on btrfs, xfs and the like, copies them otherwise
+			if (ioctl(out, FICLONE, fd) != 0) {
+				loff_t   in_offset  = 0;
+				loff_t   out_offset = 0;
+				uint64_t left       = size;
+				while (left > 0) {
+					const ssize_t copied = copy_file_range(fd, &in_offset, out, &out_offset, left, 0);
+					if (copied <= 0) {
+						::close(out);
+						::unlink(path);
+						throw std::runtime_error("copy_file_range failed");
+					}
+					left -= copied;
+				}
+			}
+			::close(out);
+		}
+
+		void set_root(void *ptr) { header()->root = ptr; }
+
+		template<class T>
+		T *root() const {
+			return (T *) header()->root;
+		}
+
+		static uint64_t sync(const void *begin, const void *end) {
+			const uint64_t b = round_down_to_multiple(uint64_t(begin), FILE_HEAP_PAGE_SIZE);
+			const uint64_t e = round_up_to_multiple(uint64_t(end), FILE_HEAP_PAGE_SIZE);
+			if (msync((void *) b, e - b, MS_SYNC) != 0) { throw std::runtime_error("msync failed"); }
+			return e - b;
+		}
+
+		static uint64_t sync_bucket(sab::bucket<64, IC> &bucket) {
+			if (!bucket.dirty) { return 0; }
+			bucket.dirty = 0;
+			// a destroyed bucket only changed the node
+			return bucket.is_initialized() ? sync(bucket.begin, bucket.end) : 0;
+		}
+	};
+} // namespace cau
+
+#endif //CUSTOM_ALLOCATOR_FILE_HEAP_H
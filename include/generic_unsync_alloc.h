@@ -1,4 +1,7 @@
+#ifndef CUSTOM_ALLOCATOR_GENERIC_UNSYNC_ALLOC_H
+#define CUSTOM_ALLOCATOR_GENERIC_UNSYNC_ALLOC_H
 
+#include "heap_profiler.h"
 #include "small_allocator.h"
 #include "utils.h"
 
@@ -6,8 +9,10 @@
 #include <cstdlib>
 #include <cstring>
 #include <iostream>
+#include <limits>
 #include <memory>
-#include <unordered_set>
+#include <type_traits>
+#include <unordered_map>
 
 namespace cau {
 	constexpr i_allocator default_allocator = {[](size_t size) -> allocation {
@@ -32,13 +37,48 @@ namespace cau {
  *  Assuming the allocator is correct, None is sufficient.
  *  Else Constant can detect bugs in the allocator, and Full can find even more.
  *  Full comes with a significant performance penalty. So it's not recommended outside unit tests.
+ * @tparam ST Statistics level.
+ *  None doesn't record anything and has no cost.
+ *  Counters records the traffic per size class, bucket usage and the reserved memory, refer to stats().
+ * @tparam DT Dirty tracking, only file_heap turns it on.
+ *  None doesn't store anything on allocation.
+ *  Buckets marks every bucket and node, that changed, so a checkpoint only writes these back.
  *
  */
-	template<i_allocator allocator, INVARIANT_CHECKING IC = INVARIANT_CHECKING::NONE>
+	template<i_allocator allocator, INVARIANT_CHECKING IC = INVARIANT_CHECKING::NONE,
+			 STATISTICS ST = STATISTICS::NONE, DIRTY_TRACKING DT = DIRTY_TRACKING::NONE>
 	struct generic_allocator {
-		Small_Allocator<64, IC> small_allocator{
+		using small_allocator_t = Small_Allocator<64, IC, ST, DT>;
+
+		// serves LIFETIME::TEMPORARY, the default
+		small_allocator_t small_allocator{
+				.allocator = allocator,
+		};
+		small_allocator_t session_allocator{
 				.allocator = allocator,
+				.lifetime  = LIFETIME::SESSION,
 		};
+		small_allocator_t permanent_allocator{
+				.allocator = allocator,
+				.lifetime  = LIFETIME::PERMANENT,
+		};
+
+		small_allocator_t &small_allocator_for(LIFETIME lifetime) {
+			if (lifetime == LIFETIME::TEMPORARY) [[likely]] { return small_allocator; }
+			return lifetime == LIFETIME::SESSION ? session_allocator : permanent_allocator;
+		}
+
+		/*
+		 * small_allocator_for, that counts the allocation of size bytes with the allocator serving it.
+		 * The allocations of the containers inside are not counted.
+		 */
+		small_allocator_t &count_small_allocation(LIFETIME lifetime, uint64_t size) {
+			small_allocator_t &buckets = small_allocator_for(lifetime);
+			if constexpr (ST == STATISTICS::COUNTERS) {
+				buckets.counters.allocations[allocator_stats::size_class(size)]++;
+			}
+			return buckets;
+		}
 
 
 		template<class T>
@@ -57,10 +97,10 @@ namespace cau {
 				using other = STD_small_allocator<U>;
 			};
 
-			Small_Allocator<64, IC> &small_allocator;
+			small_allocator_t &small_allocator;
 
 
-			STD_small_allocator(Small_Allocator<64, IC> &smallAllocator) noexcept : small_allocator(smallAllocator) {}
+			STD_small_allocator(small_allocator_t &smallAllocator) noexcept : small_allocator(smallAllocator) {}
 			STD_small_allocator(const STD_small_allocator &other) noexcept : small_allocator(other.small_allocator) {}
 			template<class U>
 			STD_small_allocator(const STD_small_allocator<U> &other) noexcept
@@ -69,7 +109,7 @@ namespace cau {
 			pointer allocate(size_type n) { return (pointer) small_allocator.allocate(n * sizeof(T)).begin; }
 
 			void deallocate(pointer p, size_type n) {
-				small_allocator.dealloc(allocation{(uint8_t *) p, (uint8_t *) p + n * sizeof(T)});
+				small_allocator.dealloc_sized(allocation{(uint8_t *) p, (uint8_t *) p + n * sizeof(T)});
 			}
 
 			bool operator==(const STD_small_allocator &other) const {
@@ -78,21 +118,113 @@ namespace cau {
 		};
 
 		// TODO replace with platform independent set
-		using Set = std::unordered_set<void *, std::hash<void *>, std::equal_to<void *>, STD_small_allocator<void *>>;
-		Set large_allocations{small_allocator};
+		// Maps the pointer handed out to the allocation of the wrapped allocator.
+		using Map = std::unordered_map<void *, allocation, std::hash<void *>, std::equal_to<void *>,
+									   STD_small_allocator<std::pair<void *const, allocation>>>;
+		// the entries live as long as the large allocations, so keep them out of the temporary buckets
+		Map large_allocations{session_allocator};
+
+		heap_profiler *profiler = nullptr;
+		// Counts down the bytes until the next sampled allocation, stays out of reach without a profiler.
+		int64_t bytes_until_sample = std::numeric_limits<int64_t>::max();
+
+		/*
+		 * Attach a sampling profiler or detach it with nullptr.
+		 * The profiler must outlive the allocator or be detached before it's destroyed.
+		 * Frees after detaching aren't reported to the profiler anymore.
+		 */
+		void set_profiler(heap_profiler *new_profiler) {
+			profiler           = new_profiler;
+			bytes_until_sample = profiler ? profiler->next_sample_distance() : std::numeric_limits<int64_t>::max();
+		}
+
+		/*
+		 * Move returning buckets to the wrapped allocator and preparing new ones to a maintenance thread.
+		 * The maintainer must outlive the allocator, nullptr detaches it.
+		 */
+		void set_maintainer(bucket_reserve *maintainer) {
+			small_allocator.set_maintainer(maintainer);
+			session_allocator.set_maintainer(maintainer);
+			permanent_allocator.set_maintainer(maintainer);
+		}
+
+		// large allocations are served by the wrapped allocator itself, the buckets count the small ones
+		[[no_unique_address]] stats_storage<ST> large_counters{};
 
 		allocation do_large_allocation(size_t size) {
 			auto alloc = allocator.alloc(size);
-			large_allocations.insert(alloc.begin);
+			// the wrapped allocator failed, nothing to track
+			if (alloc.begin == nullptr) [[unlikely]] { return alloc; }
+			large_allocations.emplace(alloc.begin, alloc);
+			if constexpr (ST == STATISTICS::COUNTERS) {
+				large_counters.allocations[allocator_stats::LARGE_SIZE_CLASS]++;
+				large_counters.large_bytes += alloc.end - alloc.begin;
+				large_counters.bytes_handed_out += alloc.end - alloc.begin;
+				large_counters.reserve(alloc.end - alloc.begin);
+			}
 			return alloc;
 		}
 
-		allocation alloc(size_t size) {
+		/*
+		 * Over-allocates alignment bytes from the wrapped allocator, to hand out an aligned pointer inside.
+		 */
+		allocation do_large_aligned_allocation(size_t size, size_t alignment) {
+			size_t padded;
+			if (__builtin_add_overflow(size, alignment, &padded)) [[unlikely]] { return {nullptr, nullptr}; }
+			auto base = allocator.alloc(padded);
+			if (base.begin == nullptr) [[unlikely]] { return base; }
+			uint8_t *begin = (uint8_t *) round_up_to_multiple(uint64_t(base.begin), alignment);
+			large_allocations.emplace(begin, base);
+			if constexpr (ST == STATISTICS::COUNTERS) {
+				large_counters.allocations[allocator_stats::LARGE_SIZE_CLASS]++;
+				large_counters.large_bytes += base.end - base.begin;
+				large_counters.bytes_handed_out += base.end - begin; // the padding before begin isn't usable
+				large_counters.reserve(base.end - base.begin);
+			}
+			return {begin, begin + size};
+		}
 
-			if (size > 32'000) { return do_large_allocation(size); }
+		[[gnu::noinline]] allocation do_sampled_allocation(size_t size, size_t alignment, LIFETIME lifetime) {
+			if (profiler == nullptr) {
+				bytes_until_sample = std::numeric_limits<int64_t>::max();
+				return do_allocation(size, alignment, lifetime);
+			}
+			bytes_until_sample = profiler->next_sample_distance();
+			allocation a       = do_allocation(size, alignment, lifetime);
+			profiler->record_alloc(a.begin, size, 1);
+			return a;
+		}
+
+		allocation alloc(size_t size) { return alloc_aligned(size, 64); }
+
+		/*
+		 * Allocation from the buckets reserved for lifetime. Keeping long-lived allocations apart lets the buckets of
+		 * the temporary ones drain and return to the wrapped allocator. Large allocations ignore the hint.
+		 */
+		allocation alloc(size_t size, LIFETIME lifetime) { return alloc_aligned(size, 64, lifetime); }
+
+		/*
+		 * Allocation starting at a multiple of alignment, which must be a power of two.
+		 * Alignments below LARGE_ALIGNMENT_THRESHOLD are served from the buckets, by searching for an aligned run.
+		 * Page alignment and above (e.g. 2 MB for huge pages) is served by over-allocating from the wrapped allocator,
+		 * every such allocation reserves alignment bytes more than size. With mmap below, the pages of the padding are
+		 * never touched, but they still take address space. The allocation is freed with dealloc like any other.
+		 */
+		allocation alloc_aligned(size_t size, size_t alignment, LIFETIME lifetime = LIFETIME::TEMPORARY) {
+			bytes_until_sample -= int64_t(size);
+			if (bytes_until_sample < 0) [[unlikely]] { return do_sampled_allocation(size, alignment, lifetime); }
+			return do_allocation(size, alignment, lifetime);
+		}
+
+		allocation do_allocation(size_t size, size_t alignment, LIFETIME lifetime) {
+			if (alignment > 64) [[unlikely]] {
+				if (is_large_allocation(size, alignment)) { return do_large_aligned_allocation(size, alignment); }
+				return count_small_allocation(lifetime, size).allocate_aligned(size, alignment);
+			}
+			if (size > LARGE_ALLOCATION_THRESHOLD) { return do_large_allocation(size); }
 
 
-			allocation a = small_allocator.allocate(size);
+			allocation a = count_small_allocation(lifetime, size).allocate(size);
 			return {
 					std::assume_aligned<64>(a.begin),
 					std::assume_aligned<64>(a.end),
@@ -100,30 +232,147 @@ namespace cau {
 		}
 
 		template<class T>
-		T *alloc(size_t count) {
-			return (T *) alloc(sizeof(T) * count).begin;
+		T *alloc(size_t count, LIFETIME lifetime = LIFETIME::TEMPORARY) {
+			return (T *) alloc(sizeof(T) * count, lifetime).begin;
 		}
 
 		/*
-	 * Since the large allocations interface is not final yet, ent in alloc must be provided for correctness.
-	 * The allocation::begin must be the exact allocation::begin provided with the allocation call. The end can be a bit off.
+		 * Allocation of N objects of type T. The path and the size of a new bucket are chosen at compile time,
+		 * small allocations go straight to the buckets of lifetime. There is no size class fast path in the buckets,
+		 * the search is the same as for a runtime size.
+		 */
+		template<class T, size_t N = 1>
+		T *alloc(LIFETIME lifetime = LIFETIME::TEMPORARY) {
+			constexpr uint64_t size      = sizeof(T) * N;
+			constexpr uint64_t alignment = max(alignof(T), 64);
+			bytes_until_sample -= int64_t(size);
+			if (bytes_until_sample < 0) [[unlikely]] {
+				return (T *) do_sampled_allocation(size, alignment, lifetime).begin;
+			}
+			if constexpr (is_large_allocation(size, alignment)) {
+				if constexpr (alignment > 64) { return (T *) do_large_aligned_allocation(size, alignment).begin; }
+				return (T *) do_large_allocation(size).begin;
+			} else if constexpr (alignment > 64) {
+				return (T *) count_small_allocation(lifetime, size).allocate_aligned(size, alignment).begin;
+			} else {
+				small_allocator_t &buckets = count_small_allocation(lifetime, size);
+				return (T *) std::assume_aligned<64>(buckets.template allocate_fixed<size>().begin);
+			}
+		}
+
+		/*
+	 * The allocation::begin must be the exact allocation::begin provided with the allocation call. The end can be a bit off,
+	 * it's only used for statistics.
 	 * @param alloc
 	 */
 		void dealloc(allocation alloc) {
+			if (profiler != nullptr && profiler->maybe_sampled(alloc.begin)) [[unlikely]] {
+				profiler->record_dealloc(alloc.begin);
+			}
+
+			auto large = large_allocations.find(alloc.begin);
+			if (large != large_allocations.end()) {
+				const allocation base = large->second;
+				if constexpr (ST == STATISTICS::COUNTERS) {
+					large_counters.deallocations[allocator_stats::LARGE_SIZE_CLASS]++;
+					large_counters.large_bytes -= base.end - base.begin;
+					large_counters.bytes_handed_out -= base.end - (uint8_t *) large->first;
+					large_counters.release(base.end - base.begin);
+				}
+				large_allocations.erase(large);
+				allocator.dealloc(base);
+				return;
+			}
+			small_allocator_t &buckets = small_allocator_for(small_allocator.lifetime_of(alloc.begin));
+			if constexpr (ST == STATISTICS::COUNTERS) {
+				buckets.counters.deallocations[allocator_stats::size_class(alloc.end - alloc.begin)]++;
+			}
+			buckets.dealloc(alloc);
+		}
+
+		/*
+		 * Deallocation without knowing the size, like free.
+		 */
+		void dealloc(void *ptr) { dealloc({(uint8_t *) ptr, (uint8_t *) ptr + usable_size(ptr)}); }
+
+		/*
+		 * Bytes usable behind ptr, at least the size requested.
+		 */
+		[[nodiscard]] uint64_t usable_size(void *ptr) const {
+			auto large = large_allocations.find(ptr);
+			if (large != large_allocations.end()) { return large->second.end - (uint8_t *) ptr; }
+			return small_allocator.usable_size(ptr);
+		}
 
-			if (large_allocations.find(alloc.begin) != large_allocations.end()) {
-				allocator.dealloc(alloc);
-				large_allocations.erase(alloc.begin);
+		/*
+		 * Deallocation of size bytes at ptr, where size and alignment are the ones requested at allocation.
+		 * Small allocations trust the size to find the slots instead of reading the header, refer to dealloc_small.
+		 * CONSTANT and above still compare it with the header. dealloc(T *, count) and the STD allocators free through
+		 * here, the std::allocator contract already requires the count of the allocation.
+		 */
+		void dealloc_sized(void *ptr, size_t size, size_t alignment = 64) {
+			if (is_large_allocation(size, alignment)) [[unlikely]] {
+				dealloc({(uint8_t *) ptr, (uint8_t *) ptr + size});
 				return;
 			}
-			small_allocator.dealloc(alloc);
+			if constexpr (IC == INVARIANT_CHECKING::CONSTANT || IC == INVARIANT_CHECKING::FULL) {
+				if (large_allocations.contains(ptr)) { throw std::runtime_error("Size does not match the allocation"); }
+			}
+			dealloc_small({(uint8_t *) ptr, (uint8_t *) ptr + size});
+			if (profiler != nullptr && profiler->maybe_sampled(ptr)) [[unlikely]] { profiler->record_dealloc(ptr); }
+		}
+
+		/*
+		 * Sized deallocation from the buckets. An allocation in the current temporary bucket needs no header,
+		 * others are routed to their lifetime and bucket by the header.
+		 */
+		void dealloc_small(allocation alloc) {
+			small_allocator_t *buckets = &small_allocator;
+			auto              *bucket  = small_allocator.current_bucket_of(alloc.begin);
+			if (bucket == nullptr) {
+				const auto *header = small_allocation_header<64, IC>(alloc.begin);
+				buckets            = &small_allocator_for(header->lifetime());
+				bucket             = header->bucket();
+			}
+			buckets->dealloc_sized(alloc, bucket);
+			// counted once freed, a size rejected by the checks leaves no trace
+			if constexpr (ST == STATISTICS::COUNTERS) {
+				buckets->counters.deallocations[allocator_stats::size_class(alloc.end - alloc.begin)]++;
+			}
 		}
 
+		/*
+		 * Destroys and frees count objects allocated with alloc<T>(count) or an allocator of T.
+		 */
 		template<class T>
 		void dealloc(T *ptr, uint64_t count) {
 			for (uint64_t i = 0; i < count; i++) { ptr[i].~T(); }
 
-			dealloc({(uint8_t *) ptr, (uint8_t *) ptr + count * sizeof(T)});
+			dealloc_sized(ptr, count * sizeof(T), max(alignof(T), 64));
+		}
+
+		/*
+		 * Counterpart of alloc<T, N>, small allocations skip the lookup in the large allocations.
+		 * T must be given explicitly, so untyped calls still end up at dealloc(void *).
+		 */
+		template<class T, size_t N = 1>
+		void dealloc(std::type_identity_t<T> *ptr) {
+			for (uint64_t i = 0; i < N; i++) { ptr[i].~T(); }
+
+			dealloc_sized(ptr, sizeof(T) * N, max(alignof(T), 64));
+		}
+
+		/*
+		 * Copy of the counters, only available with STATISTICS::COUNTERS.
+		 */
+		[[nodiscard]] allocator_stats stats() const
+			requires(ST == STATISTICS::COUNTERS)
+		{
+			allocator_stats total = large_counters;
+			total += small_allocator.stats();
+			total += session_allocator.stats();
+			total += permanent_allocator.stats();
+			return total;
 		}
 	};
 
@@ -137,8 +386,9 @@ namespace cau {
  * It's recommended to use a wrapper around the global_file_allocator, that is thread safe.
  * Therefor this is a utility for debugging and testing.
  * @tparam T type to allocate
+ * @tparam LT lifetime hint passed to every allocation, refer to generic_allocator::alloc
  */
-	template<class T>
+	template<class T, LIFETIME LT = LIFETIME::TEMPORARY>
 	struct STD_allocator {
 
 		using value_type      = T;
@@ -151,24 +401,75 @@ namespace cau {
 
 		template<class U>
 		struct rebind {
-			using other = STD_allocator<U>;
+			using other = STD_allocator<U, LT>;
 		};
 
 		// Constructors and destructors
 		STD_allocator() noexcept                      = default;
 		STD_allocator(const STD_allocator &) noexcept = default;
 		template<class U>
-		STD_allocator(const STD_allocator<U> &) noexcept {}
+		STD_allocator(const STD_allocator<U, LT> &) noexcept {}
 
 		// Allocation and deallocation
-		pointer allocate(size_type n) { return (pointer) global_file_allocator->alloc(n * sizeof(T)).begin; }
+		pointer allocate(size_type n) {
+			if constexpr (alignof(T) > 64) {
+				return (pointer) global_file_allocator->alloc_aligned(n * sizeof(T), alignof(T), LT).begin;
+			}
+			return (pointer) global_file_allocator->alloc(n * sizeof(T), LT).begin;
+		}
 
 		void deallocate(pointer p, size_type n) {
-			global_file_allocator->dealloc(allocation{(uint8_t *) p, (uint8_t *) p + n * sizeof(T)});
+			global_file_allocator->dealloc_sized(p, n * sizeof(T), max(alignof(T), 64));
 		}
 
 		// Comparison operators
 		bool operator==(const STD_allocator &) const { return true; }
 		// bool operator!=(const STD_allocator &other) const { return !(*this == other); }
 	};
+
+	// for caches and other data, that lives as long as a session or the whole program
+	template<class T>
+	using STD_session_allocator = STD_allocator<T, LIFETIME::SESSION>;
+	template<class T>
+	using STD_permanent_allocator = STD_allocator<T, LIFETIME::PERMANENT>;
+
+	/**
+	 * Like STD_allocator, but every allocation starts at a multiple of ALIGNMENT.
+	 * E.g. 128 for buffers, that span two adjacent cache lines, or 4096 for O_DIRECT buffers.
+	 * @tparam T type to allocate
+	 * @tparam ALIGNMENT power of two
+	 */
+	template<class T, uint64_t ALIGNMENT>
+	struct STD_aligned_allocator {
+
+		using value_type      = T;
+		using pointer         = T *;
+		using const_pointer   = const T *;
+		using reference       = T &;
+		using const_reference = const T &;
+		using size_type       = std::size_t;
+		using difference_type = std::ptrdiff_t;
+
+		template<class U>
+		struct rebind {
+			using other = STD_aligned_allocator<U, ALIGNMENT>;
+		};
+
+		STD_aligned_allocator() noexcept                              = default;
+		STD_aligned_allocator(const STD_aligned_allocator &) noexcept = default;
+		template<class U>
+		STD_aligned_allocator(const STD_aligned_allocator<U, ALIGNMENT> &) noexcept {}
+
+		pointer allocate(size_type n) {
+			return (pointer) global_file_allocator->alloc_aligned(n * sizeof(T), max(ALIGNMENT, alignof(T))).begin;
+		}
+
+		void deallocate(pointer p, size_type n) {
+			global_file_allocator->dealloc_sized(p, n * sizeof(T), max(max(ALIGNMENT, alignof(T)), 64));
+		}
+
+		bool operator==(const STD_aligned_allocator &) const { return true; }
+	};
 } // namespace cau
+
+#endif //CUSTOM_ALLOCATOR_GENERIC_UNSYNC_ALLOC_H
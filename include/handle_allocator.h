@@ -0,0 +1,336 @@
+#ifndef CUSTOM_ALLOCATOR_HANDLE_ALLOCATOR_H
+#define CUSTOM_ALLOCATOR_HANDLE_ALLOCATOR_H
+
+#include "small_allocator.h"
+#include "utils.h"
+
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+
+namespace cau {
+	/*
+	 * Stable reference to a relocatable allocation. The generation detects use after free.
+	 */
+	struct handle {
+		uint32_t index;
+		uint32_t generation;
+
+		bool operator==(const handle &) const = default;
+	};
+
+	/**
+	 * Allocator handing out handles instead of pointers, so the blocks can be moved.
+	 * Handles are resolved through an indirection table, compact_step moves blocks out of the sparsest bucket into
+	 * the densest ones, until the bucket is empty and returned to the wrapped allocator.
+	 * A pointer from get stays valid until the next compact_step or free of its handle.
+	 * Blocks are moved with memcpy, so only store trivially relocatable objects.
+	 * Large allocations are taken from the wrapped allocator directly and never move.
+	 * @tparam allocator wrapped allocator, refer to generic_allocator
+	 * @tparam IC invariant checking level, CONSTANT and above check the generation of every handle
+	 */
+	template<i_allocator allocator, INVARIANT_CHECKING IC = INVARIANT_CHECKING::NONE>
+	struct handle_allocator {
+		using small_allocator_t = Small_Allocator<64, IC>;
+		using bucket_t          = sab::bucket<64, IC>;
+
+		static constexpr uint32_t NO_ENTRY = UINT32_MAX;
+
+		struct entry {
+			allocation alloc;      // begin is nullptr, if the entry is free
+			uint32_t   generation; // incremented on every free
+			uint32_t   next_free;  // next free entry, if the entry is free
+			bool       large;
+		};
+
+		small_allocator_t blocks{
+				.allocator = allocator,
+		};
+
+		entry   *table     = nullptr;
+		uint32_t capacity  = 0;
+		uint32_t used      = 0; // entries, that were ever handed out
+		uint32_t free_head = NO_ENTRY;
+		uint32_t cursor    = 0; // entry, where the next compact_step continues
+
+		uint64_t blocks_moved = 0;
+		uint64_t scan_work    = 0; // units of work done by compact_step, refer to there
+
+		// compaction state, kept between the calls of compact_step
+		static constexpr uint64_t TARGET_COUNT = 4;
+
+		bucket_t                     *victim              = nullptr;
+		uint64_t                      victim_entries_left = 0; // entries to look at, until the victim is given up
+		bucket_t                     *targets[TARGET_COUNT]{};
+		small_allocator_node<64, IC> *scan_node  = nullptr; // next bucket of the scan for the victim
+		uint64_t                      scan_index = 0;
+		bucket_t                     *candidate  = nullptr; // sparsest bucket found by the scan so far
+		uint64_t                      scanned    = 0;
+		// pass over the buckets for blocks, that fit into none of the targets
+		small_allocator_node<64, IC> *fill_node         = nullptr;
+		uint64_t                      fill_index        = 0;
+		uint64_t                      fill_buckets_left = 0;
+
+		handle_allocator() = default;
+
+		handle_allocator(const handle_allocator &) = delete;
+
+		~handle_allocator() {
+			for (uint32_t i = 0; i < used; i++) {
+				if (table[i].alloc.begin != nullptr) { release(table[i]); }
+			}
+			if (table != nullptr) {
+				allocator.dealloc({(uint8_t *) table, (uint8_t *) (table + capacity)});
+			}
+		}
+
+		handle alloc(size_t size) {
+			const uint32_t index = take_entry();
+			entry         &e     = table[index];
+			e.large              = size > LARGE_ALLOCATION_THRESHOLD;
+			e.alloc              = e.large ? allocator.alloc(size) : blocks.allocate(size);
+			if (e.alloc.begin == nullptr) { throw std::bad_alloc(); }
+			return {index, e.generation};
+		}
+
+		void free(handle h) {
+			entry &e = checked_entry(h);
+			release(e);
+			e.alloc     = {nullptr, nullptr};
+			e.generation++;
+			e.next_free = free_head;
+			free_head   = h.index;
+		}
+
+		[[nodiscard]] void *get(handle h) { return checked_entry(h).alloc.begin; }
+
+		template<class T>
+		T *get(handle h) {
+			return (T *) get(h);
+		}
+
+		[[nodiscard]] uint64_t size(handle h) {
+			const entry &e = checked_entry(h);
+			return e.alloc.end - e.alloc.begin;
+		}
+
+		/*
+		 * Does at most budget units of compaction work and returns the blocks moved.
+		 * A unit is a bucket looked at while choosing the victim, an entry of the table looked at for blocks in the
+		 * victim, or a bucket tried for a block. The state is kept between the calls, so a small budget
+		 * continues where the last call stopped. The victim is the sparsest bucket less than half full, its blocks
+		 * move to the densest buckets with free slots, that are at least as dense as the victim.
+		 */
+		uint64_t compact_step(uint64_t budget) {
+			uint64_t moved = 0;
+			while (budget > 0) {
+				if (victim == nullptr) {
+					if (!scan_buckets(budget)) { return moved; }
+					// nothing sparse enough
+					if (victim == nullptr) { return moved; }
+					continue;
+				}
+				if (victim_entries_left == 0 || used == 0) {
+					// a whole pass over the table, the rest of the victim can't be moved
+					reset_compaction();
+					return moved;
+				}
+				budget--;
+				scan_work++;
+				victim_entries_left--;
+				if (cursor >= used) { cursor = 0; }
+				entry &e = table[cursor++];
+				if (e.alloc.begin == nullptr || e.large || blocks.bucket_of(e.alloc.begin) != victim) { continue; }
+
+				const uint64_t            block_size = e.alloc.end - e.alloc.begin;
+				std::optional<allocation> target     = allocate_in_targets(block_size, budget);
+				// every target is full, moving more would only shuffle blocks around
+				if (!target) {
+					reset_compaction();
+					return moved;
+				}
+				memcpy(target->begin, e.alloc.begin, block_size);
+				const bool last = victim->free_elements + block_size / 64 + 1 == victim->get_total_elements();
+				blocks.dealloc_sized(e.alloc, victim);
+				e.alloc = *target;
+				moved++;
+				blocks_moved++;
+				// the bucket was destroyed by dealloc, continue with the next victim
+				if (last) { reset_compaction(); }
+			}
+			return moved;
+		}
+
+		/*
+		 * Runs compact_step, until there is nothing left to move.
+		 */
+		void compact() {
+			while (compact_step(UINT64_MAX) != 0) {}
+		}
+
+		[[nodiscard]] uint64_t bucket_count() const {
+			uint64_t count = 0;
+			for (auto *node = &blocks.head; node != nullptr; node = node->next) {
+				count += small_allocator_node<64, IC>::BUCKET_COUNT - node->free_buckets;
+			}
+			return count;
+		}
+
+		// use / all < other_use / other_all
+		static bool sparser(uint64_t use, uint64_t all, uint64_t other_use, uint64_t other_all) {
+			return use * other_all < other_use * all;
+		}
+
+		static bool sparser(const bucket_t *bucket, const bucket_t *other) {
+			const uint64_t all       = bucket->get_total_elements();
+			const uint64_t other_all = other->get_total_elements();
+			return sparser(all - bucket->free_elements, all, other_all - other->free_elements, other_all);
+		}
+
+		/*
+		 * Continues the scan over the buckets, that picks the victim and the targets.
+		 * @return true, once the scan is complete and victim is set, or nullptr if no bucket is sparse enough
+		 */
+		bool scan_buckets(uint64_t &budget) {
+			if (scan_node == nullptr) {
+				scan_node  = &blocks.head;
+				scan_index = 0;
+			}
+			while (scan_node != nullptr) {
+				if (budget == 0) { return false; }
+				budget--;
+				scan_work++;
+				scanned++;
+				bucket_t *bucket = &scan_node->buckets[scan_index];
+				if (++scan_index == small_allocator_node<64, IC>::BUCKET_COUNT) {
+					scan_node  = scan_node->next;
+					scan_index = 0;
+				}
+				if (!bucket->is_initialized()) { continue; }
+				const uint64_t all = bucket->get_total_elements();
+				const uint64_t use = all - bucket->free_elements;
+				if (2 * use < all && (candidate == nullptr || sparser(bucket, candidate))) { candidate = bucket; }
+				if (bucket->free_elements > 0) { offer_target(bucket); }
+			}
+			victim              = candidate;
+			candidate           = nullptr;
+			victim_entries_left = used;
+			fill_buckets_left   = scanned;
+			scanned             = 0;
+			return true;
+		}
+
+		/*
+		 * Keeps the TARGET_COUNT densest buckets with free slots, the densest first.
+		 */
+		void offer_target(bucket_t *bucket) {
+			uint64_t i = TARGET_COUNT;
+			while (i > 0 && (targets[i - 1] == nullptr || sparser(targets[i - 1], bucket))) { i--; }
+			if (i == TARGET_COUNT) { return; }
+			for (uint64_t j = TARGET_COUNT - 1; j > i; j--) { targets[j] = targets[j - 1]; }
+			targets[i] = bucket;
+		}
+
+		/*
+		 * Tries the targets, a target too fragmented for size is dropped. Without targets left, the pass over the
+		 * buckets continues where it stopped for the last block, the bucket taking the block becomes a target.
+		 */
+		std::optional<allocation> allocate_in_targets(uint64_t size, uint64_t &budget) {
+			for (bucket_t *&target: targets) {
+				if (target == nullptr) { continue; }
+				if (budget == 0) { return std::nullopt; }
+				budget--;
+				scan_work++;
+				// targets may have filled up or been emptied by frees since the scan
+				if (target != victim && target->is_initialized() && !sparser(target, victim)) {
+					if (auto alloc = small_allocator_adapter<64, IC>(target, size, blocks.lifetime)) { return alloc; }
+				}
+				target = nullptr;
+			}
+			if (fill_node == nullptr) {
+				fill_node  = &blocks.head;
+				fill_index = 0;
+			}
+			while (fill_buckets_left > 0) {
+				if (budget == 0) { return std::nullopt; }
+				budget--;
+				scan_work++;
+				fill_buckets_left--;
+				bucket_t *bucket = &fill_node->buckets[fill_index];
+				if (++fill_index == small_allocator_node<64, IC>::BUCKET_COUNT) {
+					fill_node  = fill_node->next != nullptr ? fill_node->next : &blocks.head;
+					fill_index = 0;
+				}
+				if (bucket == victim || !bucket->is_initialized() || sparser(bucket, victim)) { continue; }
+				if (auto alloc = small_allocator_adapter<64, IC>(bucket, size, blocks.lifetime)) {
+					offer_target(bucket);
+					return alloc;
+				}
+			}
+			return std::nullopt;
+		}
+
+		/*
+		 * Forgets the victim, the targets and the scan. Needed whenever a bucket is destroyed, as its node may be
+		 * freed with it.
+		 */
+		void reset_compaction() {
+			victim              = nullptr;
+			candidate           = nullptr;
+			scan_node           = nullptr;
+			scanned             = 0;
+			fill_node           = nullptr;
+			fill_buckets_left   = 0;
+			victim_entries_left = 0;
+			for (bucket_t *&target: targets) { target = nullptr; }
+		}
+
+		entry &checked_entry(handle h) {
+			if constexpr (IC == INVARIANT_CHECKING::CONSTANT || IC == INVARIANT_CHECKING::FULL) {
+				if (h.index >= used || table[h.index].generation != h.generation ||
+					table[h.index].alloc.begin == nullptr) {
+					throw std::runtime_error("Stale handle");
+				}
+			}
+			return table[h.index];
+		}
+
+		void release(entry &e) {
+			if (e.large) {
+				allocator.dealloc(e.alloc);
+				return;
+			}
+			bucket_t *bucket = blocks.bucket_of(e.alloc.begin);
+			if (bucket->free_elements + (e.alloc.end - e.alloc.begin) / 64 + 1 == bucket->get_total_elements()) {
+				reset_compaction();
+			}
+			blocks.dealloc_sized(e.alloc, bucket);
+		}
+
+		uint32_t take_entry() {
+			if (free_head != NO_ENTRY) {
+				const uint32_t index = free_head;
+				free_head            = table[index].next_free;
+				return index;
+			}
+			if (used == capacity) { grow(); }
+			table[used] = entry{{nullptr, nullptr}, 0, NO_ENTRY, false};
+			return used++;
+		}
+
+		void grow() {
+			const uint32_t new_capacity = capacity == 0 ? 1024 : capacity * 2;
+			allocation     new_table    = allocator.alloc(new_capacity * sizeof(entry));
+			if (new_table.begin == nullptr) { throw std::bad_alloc(); }
+			if (table != nullptr) {
+				memcpy(new_table.begin, table, capacity * sizeof(entry));
+				allocator.dealloc({(uint8_t *) table, (uint8_t *) (table + capacity)});
+			}
+			table    = (entry *) new_table.begin;
+			capacity = new_capacity;
+		}
+	};
+} // namespace cau
+
+#endif //CUSTOM_ALLOCATOR_HANDLE_ALLOCATOR_H
@@ -0,0 +1,161 @@
+#ifndef CUSTOM_ALLOCATOR_HEAP_PROFILER_H
+#define CUSTOM_ALLOCATOR_HEAP_PROFILER_H
+
+#include <cmath>
+#include <cstdint>
+#include <execinfo.h>
+#include <fstream>
+#include <map>
+#include <ostream>
+#include <unordered_map>
+#include <vector>
+
+namespace cau {
+	/**
+	 * Sampling heap profiler, that can be attached to a generic_allocator with set_profiler.
+	 * On average one allocation per sample_interval bytes is sampled, the distance between two samples is
+	 * exponentially distributed, so allocations of all sizes have a fair chance to be picked.
+	 * For each sampled allocation the call stack is captured and the allocation is tracked until it's freed.
+	 * The allocator only decrements a counter for unsampled allocations, refer to generic_allocator::alloc.
+	 * The bookkeeping itself uses the standard allocator.
+	 * Not thread safe, like the allocator it's attached to.
+	 */
+	struct heap_profiler {
+		static constexpr uint64_t MAX_FRAMES         = 32;
+		static constexpr uint64_t MAX_SKIPPED_FRAMES = 4;
+		static constexpr uint64_t FILTER_SIZE        = 4096;
+
+		struct call_site {
+			uint64_t live_count    = 0;
+			uint64_t live_bytes    = 0;
+			uint64_t total_count   = 0;
+			uint64_t total_bytes   = 0;
+			double   live_estimate = 0.0; // unsampled live bytes, the sum of the estimates of the live samples
+		};
+
+		struct sample {
+			uint64_t   size;
+			double     estimate; // bytes represented by this sample, refer to unsample
+			call_site *site;
+		};
+
+		uint64_t sample_interval;
+		uint64_t random_state;
+
+		std::map<std::vector<void *>, call_site> call_sites;
+		std::unordered_map<void *, sample>       live_samples;
+
+		// counting filter over the live samples, so frees of unsampled memory don't need a hash lookup
+		uint16_t sampled_filter[FILTER_SIZE] = {};
+
+		uint64_t live_sampled_bytes = 0;
+		uint64_t total_samples      = 0;
+
+		explicit heap_profiler(uint64_t sample_interval = 512 * 1024, uint64_t seed = 0x9e3779b97f4a7c15)
+			: sample_interval(sample_interval), random_state(seed | 1) {}
+
+		static uint64_t filter_index(void *ptr) { return ((uint64_t(ptr) >> 6) * 0x9e3779b97f4a7c15) >> 52; }
+
+		[[nodiscard]] bool maybe_sampled(void *ptr) const { return sampled_filter[filter_index(ptr)] != 0; }
+
+		int64_t next_sample_distance() {
+			// xorshift64*
+			random_state ^= random_state >> 12;
+			random_state ^= random_state << 25;
+			random_state ^= random_state >> 27;
+			const uint64_t random = (random_state * 0x2545f4914f6cdd1d) >> 11;
+			const double   uniform = (double(random) + 1.0) / double(uint64_t(1) << 53);
+			return int64_t(-std::log(uniform) * double(sample_interval)) + 1;
+		}
+
+		/*
+		 * Records a sampled allocation with the current call stack. This frame and skip_frames of its callers are
+		 * dropped, generic_allocator skips do_sampled_allocation.
+		 * alloc itself is inlined into the caller most of the time.
+		 */
+		[[gnu::noinline]] void record_alloc(void *ptr, uint64_t size, uint64_t skip_frames = 0) {
+			void     *frames[MAX_FRAMES + MAX_SKIPPED_FRAMES + 1];
+			const int skipped = int((skip_frames < MAX_SKIPPED_FRAMES ? skip_frames : MAX_SKIPPED_FRAMES) + 1);
+			const int depth   = backtrace(frames, int(MAX_FRAMES) + skipped);
+			std::vector<void *> stack(frames + (depth > skipped ? skipped : depth), frames + depth);
+
+			call_site &site = call_sites[stack];
+			site.live_count++;
+			site.live_bytes += size;
+			site.total_count++;
+			site.total_bytes += size;
+			const double estimate = unsample(size);
+			site.live_estimate += estimate;
+
+			live_samples[ptr] = {size, estimate, &site};
+			sampled_filter[filter_index(ptr)]++;
+			live_sampled_bytes += size;
+			total_samples++;
+		}
+
+		void record_dealloc(void *ptr) {
+			auto it = live_samples.find(ptr);
+			if (it == live_samples.end()) { return; }
+			it->second.site->live_count--;
+			it->second.site->live_bytes -= it->second.size;
+			it->second.site->live_estimate -= it->second.estimate;
+			// keep the rounding errors of many frees from adding up
+			if (it->second.site->live_count == 0) { it->second.site->live_estimate = 0.0; }
+			live_sampled_bytes -= it->second.size;
+			sampled_filter[filter_index(ptr)]--;
+			live_samples.erase(it);
+		}
+
+		/*
+		 * Estimate of the bytes represented by one sample of the given size.
+		 */
+		[[nodiscard]] double unsample(uint64_t size) const {
+			if (size == 0) { return 0.0; }
+			const double probability = 1.0 - std::exp(-double(size) / double(sample_interval));
+			return double(size) / probability;
+		}
+
+		/*
+		 * Live memory in the folded stack format ("root;...;leaf bytes"), as used by flamegraph.pl.
+		 * Every sample is unsampled by its own size, so sites mixing small and large allocations are weighted correctly.
+		 * Frames are return addresses, symbolize them with addr2line or similar.
+		 */
+		void write_folded(std::ostream &out) const {
+			for (const auto &[stack, site]: call_sites) {
+				if (site.live_count == 0) { continue; }
+				for (uint64_t i = stack.size(); i > 0; i--) {
+					out << stack[i - 1];
+					if (i > 1) { out << ';'; }
+				}
+				out << ' ' << uint64_t(site.live_estimate) << '\n';
+			}
+		}
+
+		/*
+		 * Legacy gperftools heap profile, which pprof reads and unsamples itself.
+		 * The memory map of the process is appended, so pprof can symbolize the addresses.
+		 */
+		void write_pprof(std::ostream &out) const {
+			call_site total{};
+			for (const auto &[stack, site]: call_sites) {
+				total.live_count += site.live_count;
+				total.live_bytes += site.live_bytes;
+				total.total_count += site.total_count;
+				total.total_bytes += site.total_bytes;
+			}
+			out << "heap profile: " << total.live_count << ": " << total.live_bytes << " [" << total.total_count
+				<< ": " << total.total_bytes << "] @ heap_v2/" << sample_interval << '\n';
+			for (const auto &[stack, site]: call_sites) {
+				out << site.live_count << ": " << site.live_bytes << " [" << site.total_count << ": "
+					<< site.total_bytes << "] @";
+				for (void *frame: stack) { out << ' ' << frame; }
+				out << '\n';
+			}
+			out << "\nMAPPED_LIBRARIES:\n";
+			std::ifstream maps("/proc/self/maps");
+			out << maps.rdbuf();
+		}
+	};
+} // namespace cau
+
+#endif //CUSTOM_ALLOCATOR_HEAP_PROFILER_H
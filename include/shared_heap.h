@@ -0,0 +1,262 @@
+#ifndef CUSTOM_ALLOCATOR_SHARED_HEAP_H
+#define CUSTOM_ALLOCATOR_SHARED_HEAP_H
+
+#include "small_allocation_bucket.h"
+#include "utils.h"
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace cau {
+	/*
+	 * Lives at the start of the segment. Only offsets relative to the segment are stored,
+	 * so every process can map the segment at a different address.
+	 */
+	struct shared_heap_header {
+		static constexpr uint64_t MAGIC_NUMBER = 0x5348415245444850;
+
+		std::atomic<uint64_t> magic_number; // set last, once the header is initialized
+		uint64_t              size;
+		uint64_t              memory_offset;
+		uint64_t              free_list_offset;
+		uint64_t              end_of_free_list_offset;
+		uint64_t              free_elements;
+		uint64_t              search_hint; // byte of the free list, where the last allocation was found
+		uint64_t              root;        // offset of an object chosen by the user, 0 if there is none
+		pthread_mutex_t       lock;
+	};
+
+	/**
+	 * Heap in a POSIX shared memory segment, that several processes allocate from and read at the same time.
+	 * The segment is managed like a single sab::bucket: a bitmap with one bit per ALIGNMENT bytes,
+	 * each allocation is preceded by a header slot holding its size.
+	 * A robust process-shared mutex serializes alloc and dealloc. If a process dies while holding it,
+	 * the next process takes over the lock.
+	 * Pointers differ between processes, so store offsets in shared data, refer to offset_of and at.
+	 * It's not built on generic_allocator: its nodes, buckets and allocation headers hold raw pointers, new nodes
+	 * come from a per process wrapped allocator and the large allocations live in a std::unordered_map.
+	 * None of that can be shared at different addresses. So there are no size classes and no growth,
+	 * the segment is sized at creation. file_heap keeps the whole generic_allocator in a mapping at a fixed address,
+	 * but for a single writer.
+	 * @tparam ALIGNMENT granularity and alignment of the allocations
+	 * @tparam IC invariant checking level, refer to generic_allocator
+	 */
+	template<uint64_t ALIGNMENT = 64, INVARIANT_CHECKING IC = INVARIANT_CHECKING::NONE>
+	struct shared_heap {
+		uint8_t *base = nullptr;
+		uint64_t size = 0;
+
+		shared_heap() = default;
+
+		shared_heap(uint8_t *base, uint64_t size) : base(base), size(size) {}
+
+		shared_heap(const shared_heap &) = delete;
+
+		shared_heap(shared_heap &&other) noexcept : base(other.base), size(other.size) { other.base = nullptr; }
+
+		~shared_heap() {
+			if (base != nullptr) { munmap(base, size); }
+		}
+
+		/*
+		 * Creates a new segment of size bytes, fails if name exists already.
+		 */
+		static shared_heap create(const char *name, uint64_t size) {
+			int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+			if (fd < 0) { throw std::runtime_error("shm_open failed"); }
+			if (ftruncate(fd, off_t(size)) != 0) {
+				close(fd);
+				shm_unlink(name);
+				throw std::runtime_error("ftruncate failed");
+			}
+			shared_heap heap = map(fd, size);
+			heap.initialize();
+			return heap;
+		}
+
+		/*
+		 * Maps an existing segment, waits up to timeout_ms until its creator has initialized it.
+		 * Fails, if the creator died before, the segment is unusable then and should be unlinked.
+		 */
+		static shared_heap open(const char *name, uint64_t timeout_ms = 1000) {
+			const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+			int        fd       = shm_open(name, O_RDWR, 0600);
+			if (fd < 0) { throw std::runtime_error("shm_open failed"); }
+			struct stat st {};
+			// the creator may not have sized the segment yet
+			while (true) {
+				if (fstat(fd, &st) != 0) {
+					close(fd);
+					throw std::runtime_error("fstat failed");
+				}
+				if (uint64_t(st.st_size) >= sizeof(shared_heap_header)) { break; }
+				if (std::chrono::steady_clock::now() > deadline) {
+					close(fd);
+					throw std::runtime_error("Shared heap was never initialized");
+				}
+				sched_yield();
+			}
+			shared_heap heap = map(fd, uint64_t(st.st_size));
+			while (heap.header()->magic_number.load(std::memory_order_acquire) != shared_heap_header::MAGIC_NUMBER) {
+				if (std::chrono::steady_clock::now() > deadline) {
+					throw std::runtime_error("Shared heap was never initialized");
+				}
+				sched_yield();
+			}
+			return heap;
+		}
+
+		/*
+		 * Removes the name, the segment itself lives on until the last process unmapped it.
+		 */
+		static void unlink(const char *name) { shm_unlink(name); }
+
+		static shared_heap map(int fd, uint64_t size) {
+			void *ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+			close(fd);
+			if (ptr == MAP_FAILED) { throw std::runtime_error("mmap failed"); }
+			return shared_heap((uint8_t *) ptr, size);
+		}
+
+		[[nodiscard]] shared_heap_header *header() const { return (shared_heap_header *) base; }
+
+		void initialize() {
+			shared_heap_header *h = new (base) shared_heap_header{};
+
+			pthread_mutexattr_t attributes;
+			pthread_mutexattr_init(&attributes);
+			pthread_mutexattr_setpshared(&attributes, PTHREAD_PROCESS_SHARED);
+			pthread_mutexattr_setrobust(&attributes, PTHREAD_MUTEX_ROBUST);
+			pthread_mutex_init(&h->lock, &attributes);
+			pthread_mutexattr_destroy(&attributes);
+
+			// same layout as sab::bucket: memory first, then one bit per slot
+			const uint64_t begin  = round_up_to_multiple(sizeof(shared_heap_header), ALIGNMENT);
+			const uint64_t usable = round_down_to_multiple_plus_one(size - begin, ALIGNMENT * 8);
+			if (size <= begin || usable == 0) { throw std::runtime_error("Segment is too small"); }
+			h->size                    = size;
+			h->memory_offset           = begin;
+			h->free_list_offset        = begin + usable * (ALIGNMENT * 8) / (ALIGNMENT * 8 + 1);
+			h->end_of_free_list_offset = begin + usable;
+			h->free_elements           = (h->free_list_offset - begin) / ALIGNMENT;
+			h->search_hint             = 0;
+			h->root                    = 0;
+			// ftruncate zeroed the segment, so the free list is empty already
+			h->magic_number.store(shared_heap_header::MAGIC_NUMBER, std::memory_order_release);
+		}
+
+		struct lock_guard {
+			shared_heap_header *h;
+
+			explicit lock_guard(shared_heap_header *h) : h(h) {
+				if (pthread_mutex_lock(&h->lock) == EOWNERDEAD) {
+					// The previous owner died, possibly between updating the free list and free_elements.
+					// The free list is the truth, at worst some slots stay flagged and leak.
+					uint8_t *base    = (uint8_t *) h;
+					h->free_elements = sab::count_free_slots(
+							{base + h->free_list_offset, base + h->end_of_free_list_offset});
+					h->search_hint = 0;
+					pthread_mutex_consistent(&h->lock);
+				}
+			}
+
+			~lock_guard() { pthread_mutex_unlock(&h->lock); }
+		};
+
+		[[nodiscard]] sab::bucket_range free_list() const {
+			return {base + header()->free_list_offset, base + header()->end_of_free_list_offset};
+		}
+
+		[[nodiscard]] uint8_t *memory() const { return base + header()->memory_offset; }
+
+		[[nodiscard]] uint64_t total_elements() const {
+			return (header()->free_list_offset - header()->memory_offset) / ALIGNMENT;
+		}
+
+		[[nodiscard]] uint64_t free_elements() const {
+			lock_guard guard(header());
+			return header()->free_elements;
+		}
+
+		allocation alloc(size_t size) {
+			const uint64_t slots = round_up_to_multiple(size, ALIGNMENT) / ALIGNMENT + 1;
+
+			shared_heap_header *h = header();
+			lock_guard          guard(h);
+			if (slots > h->free_elements) { throw std::bad_alloc(); }
+
+			// next fit: continue after the last allocation, then retry from the start
+			const sab::bucket_range list = free_list();
+			const uint64_t          hint = h->search_hint < uint64_t(list.end - list.begin) ? h->search_hint : 0;
+			sab::bucket_range       res  = sab::get_first_fit<ALIGNMENT>({list.begin + hint, list.end}, h->free_elements,
+																		 slots, memory() + hint * 8 * ALIGNMENT);
+			if (res.begin == nullptr && hint != 0) {
+				res = sab::get_first_fit<ALIGNMENT>(list, h->free_elements, slots, memory());
+			}
+			if (res.begin == nullptr) { throw std::bad_alloc(); }
+
+			sab::flag_range_in_free_list<ALIGNMENT>(list.begin, memory(), res.begin, res.end, true);
+			h->free_elements -= slots;
+			h->search_hint = (res.begin - memory()) / ALIGNMENT / 8;
+
+			*(uint64_t *) res.begin = slots;
+			return {res.begin + ALIGNMENT, res.end};
+		}
+
+		void dealloc(void *ptr) {
+			uint8_t       *begin = (uint8_t *) ptr - ALIGNMENT;
+			const uint64_t slots = *(uint64_t *) begin;
+
+			shared_heap_header *h = header();
+			lock_guard          guard(h);
+			if constexpr (IC == INVARIANT_CHECKING::CONSTANT || IC == INVARIANT_CHECKING::FULL) {
+				if (begin < memory() || begin + slots * ALIGNMENT > base + h->free_list_offset ||
+					(begin - memory()) % ALIGNMENT != 0) {
+					throw std::runtime_error("Not in range");
+				}
+			}
+			sab::flag_range_in_free_list<ALIGNMENT>(free_list().begin, memory(), begin, begin + slots * ALIGNMENT,
+													false);
+			h->free_elements += slots;
+			if constexpr (IC == INVARIANT_CHECKING::FULL) {
+				if (h->free_elements != sab::count_free_slots(free_list())) {
+					throw std::runtime_error("free_elements is not correct");
+				}
+			}
+		}
+
+		void dealloc(allocation alloc) { dealloc(alloc.begin); }
+
+		template<class T>
+		T *alloc(size_t count) {
+			return (T *) alloc(sizeof(T) * count).begin;
+		}
+
+		[[nodiscard]] uint64_t offset_of(const void *ptr) const { return (const uint8_t *) ptr - base; }
+
+		template<class T>
+		T *at(uint64_t offset) const {
+			return (T *) (base + offset);
+		}
+
+		void set_root(uint64_t offset) {
+			lock_guard guard(header());
+			header()->root = offset;
+		}
+
+		[[nodiscard]] uint64_t root() const {
+			lock_guard guard(header());
+			return header()->root;
+		}
+	};
+} // namespace cau
+
+#endif //CUSTOM_ALLOCATOR_SHARED_HEAP_H
@@ -109,6 +109,33 @@ namespace cau::sab {
 		}
 	}
 
+	/*
+	 * Like get_first_fit, but the returned range starts at a slot, whose address plus offset is a multiple of alignment.
+	 * Only these slots are tried, so a run is skipped as soon as it hits an occupied slot.
+	 */
+	template<uint64_t ALIGNMENT = 64>
+	bucket_range get_first_aligned_fit(bucket_range free_list, uint64_t size, uint8_t *begin_of_allocatable_memory,
+									   uint64_t alignment, uint64_t offset) {
+		const uint64_t total_slots = (free_list.end - free_list.begin) * 8;
+		const uint64_t step        = alignment / ALIGNMENT;
+		// first slot, that is aligned after adding the offset
+		uint64_t       candidate   = (round_up_to_multiple(uint64_t(begin_of_allocatable_memory) + offset, alignment) -
+										offset - uint64_t(begin_of_allocatable_memory)) /
+									 ALIGNMENT;
+
+		while (candidate + size <= total_slots) {
+			uint64_t slot = candidate;
+			while (slot < candidate + size && !((free_list.begin[slot / 8] >> (slot % 8)) & 1)) { slot++; }
+			if (slot == candidate + size) {
+				return {begin_of_allocatable_memory + candidate * ALIGNMENT,
+						begin_of_allocatable_memory + (candidate + size) * ALIGNMENT};
+			}
+			// the next candidate, that doesn't contain the occupied slot
+			candidate += round_up_to_multiple(slot + 1 - candidate, step);
+		}
+		return {nullptr, nullptr};
+	}
+
 	uint64_t count_free_slots(bucket_range free_list) {
 		uint64_t           total_free_space_left = 0;
 		free_list_iterator it                    = {free_list.begin, 0};
@@ -149,6 +176,7 @@ namespace cau::sab {
 		uint8_t                  *end                = nullptr; // unused space
 		uint64_t                  free_elements      = 0;
 		void                     *container          = nullptr;
+		uint64_t                  dirty              = 0; // set by Small_Allocator, refer to DIRTY_TRACKING
 
 
 		[[nodiscard]] bool corrupted() const {
@@ -176,7 +204,10 @@ namespace cau::sab {
 
 		bucket() = default;
 
-		bucket(uint8_t *begin_, uint8_t *end_, void *container)
+		/*
+		 * zeroed skips clearing the memory, if it's known to be zero already.
+		 */
+		bucket(uint8_t *begin_, uint8_t *end_, void *container, bool zeroed = false)
 			: initialized(1), begin(begin_), end(end_), container(container) {
 			const auto [begin_aligned, end_aligned] = align_to({begin, end}, ALIGNMENT);
 
@@ -193,9 +224,10 @@ namespace cau::sab {
 			begin_of_free_list = begin_aligned + size_of_memory;
 			end_of_free_list   = begin_aligned + size;
 
-			memset(begin_aligned, 0, size);
+			if (!zeroed) { memset(begin_aligned, 0, size); }
 
-			free_elements = size / ALIGNMENT;
+			// one bit per slot, the free list isn't allocatable
+			free_elements = size_of_memory / ALIGNMENT;
 		}
 
 		void destroy() { initialized = 0; }
@@ -227,6 +259,32 @@ namespace cau::sab {
 			return allocation{res.begin, res.end};
 		}
 
+		/*
+		 * Allocates size bytes, such that begin + offset is a multiple of alignment.
+		 * alignment must be a power of two larger than ALIGNMENT and offset a multiple of ALIGNMENT.
+		 */
+		std::optional<allocation> try_alloc_aligned(uint64_t size, uint64_t alignment, uint64_t offset) {
+			if constexpr (ic == INVARIANT_CHECKING::CONSTANT || ic == INVARIANT_CHECKING::FULL) {
+				if (corrupted()) { throw std::runtime_error("corrupt"); }
+				if (alignment % ALIGNMENT != 0 || offset % ALIGNMENT != 0) {
+					throw std::runtime_error("alignment is not a multiple of the bucket alignment");
+				}
+			}
+			size = round_up_to_multiple(size, ALIGNMENT);
+
+			if (size > free_elements * ALIGNMENT) { return std::nullopt; }
+
+			auto res = get_first_aligned_fit<ALIGNMENT>({begin_of_free_list, end_of_free_list}, size / ALIGNMENT,
+														begin_of_memory, alignment, offset);
+
+			if (res.begin == nullptr || res.end == nullptr) { return std::nullopt; }
+
+			flag_range_in_free_list<ALIGNMENT>(begin_of_free_list, begin_of_memory, res.begin, res.end, true);
+			free_elements -= size / ALIGNMENT;
+
+			return allocation{res.begin, res.end};
+		}
+
 		enum class DEALLOC_ERROR {
 			SUCCESS,
 			NOT_IN_RANGE,
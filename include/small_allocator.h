@@ -5,6 +5,8 @@
 #ifndef CUSTOM_ALLOCATOR_SMALL_ALLOCATOR_H
 #define CUSTOM_ALLOCATOR_SMALL_ALLOCATOR_H
 
+#include "allocator_stats.h"
+#include "bucket_reserve.h"
 #include "small_allocation_bucket.h"
 
 #include <cstdint>
@@ -16,18 +18,43 @@
 
 
 namespace cau {
-	template<uint64_t ALIGNMENT = 64>
+	/*
+	 * Precedes every small allocation in its own slot.
+	 * The size is a multiple of ALIGNMENT, so its low bits hold the lifetime and a free finds its allocator
+	 * without going through the bucket and its node.
+	 */
+	template<uint64_t ALIGNMENT = 64, INVARIANT_CHECKING IC = INVARIANT_CHECKING::NONE>
 	struct SAB_Header {
-		uint64_t                size;
-		sab::bucket<ALIGNMENT> *bucket;
+		static constexpr uint64_t LIFETIME_MASK = 3;
+		static_assert(ALIGNMENT > LIFETIME_MASK, "The lifetime must fit below the alignment");
+
+		uint64_t                    bytes; // of the allocation including the header, or-ed with the lifetime
+		sab::bucket<ALIGNMENT, IC> *owner;
+
+		SAB_Header(sab::bucket<ALIGNMENT, IC> *bucket, uint64_t size, LIFETIME lifetime)
+			: bytes(size | uint64_t(lifetime)), owner(bucket) {}
+
+		[[nodiscard]] sab::bucket<ALIGNMENT, IC> *bucket() const { return owner; }
+
+		[[nodiscard]] uint64_t size() const { return bytes & ~LIFETIME_MASK; }
+
+		[[nodiscard]] LIFETIME lifetime() const { return LIFETIME(bytes & LIFETIME_MASK); }
 	};
 
-	template<uint64_t ALIGNMENT = 64>
-	inline std::optional<allocation> small_allocator_adapter(sab::bucket<ALIGNMENT> *bucket, size_t size) {
+	static_assert(sizeof(SAB_Header<>) <= 64, "The header must fit into its slot");
+
+	template<uint64_t ALIGNMENT = 64, INVARIANT_CHECKING IC = INVARIANT_CHECKING::NONE>
+	inline const SAB_Header<ALIGNMENT, IC> *small_allocation_header(const void *ptr) {
+		return (const SAB_Header<ALIGNMENT, IC> *) ((const uint8_t *) ptr - ALIGNMENT);
+	}
+
+	template<uint64_t ALIGNMENT = 64, INVARIANT_CHECKING IC = INVARIANT_CHECKING::NONE>
+	inline std::optional<allocation> small_allocator_adapter(sab::bucket<ALIGNMENT, IC> *bucket, size_t size,
+															 LIFETIME lifetime) {
 		auto alloc_try = bucket->try_alloc(size + ALIGNMENT);
 		if (alloc_try) {
 			allocation alloc = *alloc_try;
-			new (alloc.begin) SAB_Header<ALIGNMENT>{uint64_t(alloc.end - alloc.begin), bucket};
+			new (alloc.begin) SAB_Header<ALIGNMENT, IC>(bucket, alloc.end - alloc.begin, lifetime);
 			alloc.begin += ALIGNMENT;
 			return alloc;
 		}
@@ -35,15 +62,37 @@ namespace cau {
 	}
 
 
-	template<uint64_t ALIGNMENT = 64>
-	inline std::pair<typename sab::bucket<ALIGNMENT>::DEALLOC_ERROR, sab::bucket<ALIGNMENT> *>
+	/*
+	 * Like small_allocator_adapter, but the returned begin is a multiple of alignment.
+	 */
+	template<uint64_t ALIGNMENT = 64, INVARIANT_CHECKING IC = INVARIANT_CHECKING::NONE>
+	inline std::optional<allocation> small_allocator_aligned_adapter(sab::bucket<ALIGNMENT, IC> *bucket, size_t size,
+																	 uint64_t alignment, LIFETIME lifetime) {
+		auto alloc_try = bucket->try_alloc_aligned(size + ALIGNMENT, alignment, ALIGNMENT);
+		if (alloc_try) {
+			allocation alloc = *alloc_try;
+			new (alloc.begin) SAB_Header<ALIGNMENT, IC>(bucket, alloc.end - alloc.begin, lifetime);
+			alloc.begin += ALIGNMENT;
+			return alloc;
+		}
+		return std::nullopt;
+	}
+
+	template<uint64_t ALIGNMENT = 64, INVARIANT_CHECKING IC = INVARIANT_CHECKING::NONE>
+	inline uint64_t small_allocation_usable_size(const void *ptr) {
+		return small_allocation_header<ALIGNMENT, IC>(ptr)->size() - ALIGNMENT;
+	}
+
+	template<uint64_t ALIGNMENT = 64, INVARIANT_CHECKING IC = INVARIANT_CHECKING::NONE>
+	inline std::pair<typename sab::bucket<ALIGNMENT, IC>::DEALLOC_ERROR, sab::bucket<ALIGNMENT, IC> *>
 	deallocate_small_allocation_adapter(allocation alloc) {
-		auto *header = (SAB_Header<ALIGNMENT> *) (alloc.begin - 64);
-		if (!header->bucket->is_initialized()) {
-			return std::make_pair(sab::bucket<ALIGNMENT>::DEALLOC_ERROR::CORRUPTED, nullptr);
+		const auto                 *header = small_allocation_header<ALIGNMENT, IC>(alloc.begin);
+		sab::bucket<ALIGNMENT, IC> *bucket = header->bucket();
+		if (!bucket->is_initialized()) {
+			return std::make_pair(sab::bucket<ALIGNMENT, IC>::DEALLOC_ERROR::CORRUPTED, nullptr);
 		}
-		return std::make_pair(header->bucket->dealloc({(uint8_t *) header, (uint8_t *) header + header->size}),
-							  header->bucket);
+		return std::make_pair(bucket->dealloc({alloc.begin - ALIGNMENT, alloc.begin - ALIGNMENT + header->size()}),
+							  bucket);
 	}
 
 
@@ -57,6 +106,7 @@ namespace cau {
 		small_allocator_node *next         = nullptr;
 		small_allocator_node *prev         = nullptr;
 		uint64_t              free_buckets = BUCKET_COUNT;
+		uint64_t              dirty        = 0; // links or buckets built or destroyed, refer to DIRTY_TRACKING
 
 
 		void debug_print() {
@@ -93,10 +143,12 @@ namespace cau {
 		}
 	};
 
-	template<uint64_t ALIGNMENT = 64, INVARIANT_CHECKING IC = INVARIANT_CHECKING::NONE>
+	template<uint64_t ALIGNMENT = 64, INVARIANT_CHECKING IC = INVARIANT_CHECKING::NONE,
+			 STATISTICS ST = STATISTICS::NONE, DIRTY_TRACKING DT = DIRTY_TRACKING::NONE>
 	struct Small_Allocator {
 		small_allocator_node<ALIGNMENT, IC> head{};
 		i_allocator                         allocator;
+		LIFETIME                            lifetime = LIFETIME::TEMPORARY;
 		// due to the assumption that allocations are short-lived, we try to allocate from the last bucket first.
 
 		struct NodeIterator {
@@ -133,6 +185,31 @@ namespace cau {
 
 		NodeIterator current_node = {&head, 0};
 
+		bucket_reserve *maintainer = nullptr;
+
+		/*
+		 * Attach a maintenance thread or detach it with nullptr, refer to bucket_maintainer.
+		 */
+		void set_maintainer(bucket_reserve *new_maintainer) { maintainer = new_maintainer; }
+
+		[[no_unique_address]] stats_storage<ST> counters{};
+
+		[[nodiscard]] const allocator_stats &stats() const
+			requires(ST == STATISTICS::COUNTERS)
+		{
+			return counters;
+		}
+
+		void mark_dirty(sab::bucket<ALIGNMENT, IC> *bucket) {
+			if constexpr (DT == DIRTY_TRACKING::BUCKETS) { bucket->dirty = 1; }
+		}
+
+		void mark_dirty(small_allocator_node<ALIGNMENT, IC> *node) {
+			if constexpr (DT == DIRTY_TRACKING::BUCKETS) {
+				if (node != nullptr) { node->dirty = 1; }
+			}
+		}
+
 		void destroy_unused_bucket(sab::bucket<ALIGNMENT, IC> *bucket) {
 			small_allocator_node<ALIGNMENT, IC> *container = (small_allocator_node<ALIGNMENT, IC> *) bucket->container;
 
@@ -140,8 +217,13 @@ namespace cau {
 			if constexpr (IC == INVARIANT_CHECKING::CONSTANT || IC == INVARIANT_CHECKING::FULL) {
 				if (!container->is_bucket_in_range(bucket)) { throw std::runtime_error("Bucket is not in range"); }
 			}
-			allocator.dealloc({bucket->begin, bucket->end});
+			release_to_allocator({bucket->begin, bucket->end});
+			if constexpr (ST == STATISTICS::COUNTERS) {
+				counters.buckets_destroyed++;
+				counters.release(bucket->end - bucket->begin);
+			}
 			bucket->destroy();
+			mark_dirty(container);
 
 			container->free_buckets++;
 			if constexpr (IC == INVARIANT_CHECKING::FULL) { container->validate_free_bucket_count(); }
@@ -165,18 +247,57 @@ namespace cau {
 
 			if (container->prev != nullptr) { container->prev->next = container->next; }
 			if (container->next != nullptr) { container->next->prev = container->prev; }
+			mark_dirty(container->prev);
+			mark_dirty(container->next);
 
 
-			allocator.dealloc(
+			release_to_allocator(
 					{(uint8_t *) container, (uint8_t *) container + sizeof(small_allocator_node<ALIGNMENT, IC>)});
+			if constexpr (ST == STATISTICS::COUNTERS) {
+				counters.nodes_destroyed++;
+				counters.release(sizeof(small_allocator_node<ALIGNMENT, IC>));
+			}
 		}
 
 		void dealloc(allocation alloc) {
-			auto [res, bucket] = deallocate_small_allocation_adapter(alloc);
+			if constexpr (ST == STATISTICS::COUNTERS) {
+				counters.bytes_handed_out -= usable_size(alloc.begin);
+			}
+			auto [res, bucket] = deallocate_small_allocation_adapter<ALIGNMENT, IC>(alloc);
+			finish_dealloc(res, bucket);
+		}
+
+		/*
+		 * Like dealloc, but alloc.end must be the begin plus the size requested, which gives the slots to free.
+		 * The header is only read, if the allocation isn't in the current bucket.
+		 */
+		void dealloc_sized(allocation alloc) {
+			sab::bucket<ALIGNMENT, IC> *bucket = current_bucket_of(alloc.begin);
+			dealloc_sized(alloc, bucket != nullptr ? bucket : bucket_of(alloc.begin));
+		}
+
+		/*
+		 * dealloc_sized with the bucket holding the allocation already known.
+		 * CONSTANT and above compare both with the header.
+		 */
+		void dealloc_sized(allocation alloc, sab::bucket<ALIGNMENT, IC> *bucket) {
+			const uint64_t size = round_up_to_multiple(uint64_t(alloc.end - alloc.begin), ALIGNMENT);
+			if constexpr (IC == INVARIANT_CHECKING::CONSTANT || IC == INVARIANT_CHECKING::FULL) {
+				const auto *header = small_allocation_header<ALIGNMENT, IC>(alloc.begin);
+				if (header->bucket() != bucket) { throw std::runtime_error("Allocation is not in the bucket"); }
+				if (header->size() != size + ALIGNMENT) {
+					throw std::runtime_error("Size does not match the allocation");
+				}
+			}
+			if constexpr (ST == STATISTICS::COUNTERS) { counters.bytes_handed_out -= size; }
+			finish_dealloc(bucket->dealloc({alloc.begin - ALIGNMENT, alloc.begin + size}), bucket);
+		}
 
+		void finish_dealloc(typename sab::bucket<ALIGNMENT, IC>::DEALLOC_ERROR res,
+							sab::bucket<ALIGNMENT, IC> *bucket) {
 			if constexpr (IC == INVARIANT_CHECKING::FULL) {
 				if (sab::free_list_is_empty({bucket->begin_of_free_list, bucket->end_of_free_list}) &&
-					res != sab::bucket<ALIGNMENT>::DEALLOC_ERROR::SUCCESS_NOW_EMPTY) {
+					res != sab::bucket<ALIGNMENT, IC>::DEALLOC_ERROR::SUCCESS_NOW_EMPTY) {
 					throw std::runtime_error("Free list is empty but dealloc was not successful");
 				}
 			}
@@ -191,21 +312,91 @@ namespace cau {
 					throw std::runtime_error("Not aligned");
 				}
 			}
+			if (bucket != nullptr) { mark_dirty(bucket); }
 			if (res == sab::bucket<ALIGNMENT, IC>::DEALLOC_ERROR::SUCCESS_NOW_EMPTY) { destroy_unused_bucket(bucket); }
 		}
 
+		/*
+		 * The current bucket, if it holds ptr, else nullptr. Most frees of short-lived allocations end up here.
+		 */
+		[[nodiscard]] sab::bucket<ALIGNMENT, IC> *current_bucket_of(const void *ptr) {
+			sab::bucket<ALIGNMENT, IC> *bucket = current_node.get_current_bucket();
+			if (bucket->is_initialized() && (const uint8_t *) ptr > bucket->begin_of_memory &&
+				(const uint8_t *) ptr < bucket->begin_of_free_list) {
+				return bucket;
+			}
+			return nullptr;
+		}
+
+		/*
+		 * Bucket, that holds the allocation starting at ptr.
+		 */
+		[[nodiscard]] sab::bucket<ALIGNMENT, IC> *bucket_of(const void *ptr) const {
+			return small_allocation_header<ALIGNMENT, IC>(ptr)->bucket();
+		}
+
+		/*
+		 * Lifetime of the allocator, that allocated ptr. Refer to generic_allocator::alloc.
+		 */
+		[[nodiscard]] LIFETIME lifetime_of(const void *ptr) const {
+			return small_allocation_header<ALIGNMENT, IC>(ptr)->lifetime();
+		}
+
+		[[nodiscard]] uint64_t usable_size(const void *ptr) const {
+			return small_allocation_usable_size<ALIGNMENT, IC>(ptr);
+		}
+
 		small_allocator_node<ALIGNMENT, IC> *allocate_new_node() {
 			// Evaluate, to use this allocator itself to allocate new nodes.
 			auto alloc = allocator.alloc(sizeof(small_allocator_node<ALIGNMENT, IC>));
 			if (alloc.begin == nullptr) { throw std::bad_alloc(); }
+			if constexpr (ST == STATISTICS::COUNTERS) {
+				counters.nodes_created++;
+				counters.reserve(sizeof(small_allocator_node<ALIGNMENT, IC>));
+			}
 			new (alloc.begin) small_allocator_node<ALIGNMENT, IC>{};
 			return (small_allocator_node<ALIGNMENT, IC> *) alloc.begin;
 		}
 
-		sab::bucket<ALIGNMENT, IC> *construct_new_bucket(uint64_t minimal_size) {
+		/*
+		 * Bytes to allocate from the wrapped allocator for a bucket, that can hold minimal_size bytes.
+		 */
+		static constexpr uint64_t bucket_allocation_size(uint64_t minimal_size) {
 			// correct minimal size to account of overhead of bucket
 			minimal_size = max(minimal_size * 12 / 10 /*add 20 %*/, ALIGNMENT * 50) +
 						   3 * ALIGNMENT /* correct possibility of incorrect alignment and add allocation header*/;
+			return minimal_size * 12 / 10 /*add 20 %*/;
+		}
+
+		/*
+		 * Takes the memory from the reserve of the maintainer, if possible.
+		 */
+		void build_bucket(sab::bucket<ALIGNMENT, IC> *bucket, uint64_t size, small_allocator_node<ALIGNMENT, IC> *node) {
+			std::optional<allocation> alloc = maintainer ? maintainer->take_bucket(size) : std::nullopt;
+			const bool                zeroed = alloc.has_value();
+			if (!alloc) { alloc = allocator.alloc(size); }
+			if (alloc->begin == nullptr) { throw std::bad_alloc(); }
+			if constexpr (ST == STATISTICS::COUNTERS) {
+				counters.buckets_created++;
+				counters.reserve(alloc->end - alloc->begin);
+			}
+			new (bucket) sab::bucket<ALIGNMENT, IC>(alloc->begin, alloc->end, node, zeroed);
+			mark_dirty(node);
+		}
+
+		/*
+		 * Hands memory back to the wrapped allocator, through the maintainer if there is one.
+		 */
+		void release_to_allocator(allocation alloc) {
+			if (maintainer) {
+				maintainer->retire(alloc);
+			} else {
+				allocator.dealloc(alloc);
+			}
+		}
+
+		sab::bucket<ALIGNMENT, IC> *construct_new_bucket(uint64_t minimal_size) {
+			const uint64_t size = bucket_allocation_size(minimal_size);
 			// Step 1: Find corrupted bucket and if found allocate a new bucket.
 			NodeIterator it      = current_node;
 			NodeIterator it_copy = it;
@@ -213,10 +404,7 @@ namespace cau {
 				sab::bucket<ALIGNMENT, IC> *bucket = it.get_current_bucket();
 				if (!bucket->is_initialized()) {
 					// If a non-initialized bucket is found, try to allocate a new bucket.
-					auto alloc = allocator.alloc(minimal_size * 12 / 10 /*add 20 %*/);
-					if (alloc.begin == nullptr) { throw std::bad_alloc(); }
-					// If allocation was successful, construct a new bucket.
-					new (bucket) sab::bucket(alloc.begin, alloc.end, it.current_node);
+					build_bucket(bucket, size, it.current_node);
 					it.current_node->free_buckets--;
 					it.current_node->validate_free_bucket_count();
 
@@ -236,39 +424,85 @@ namespace cau {
 			while (node->next != nullptr) { node = node->next; }
 			node->next     = new_node;
 			new_node->prev = node;
+			mark_dirty(node);
 			// construct new bucket
-			auto alloc = allocator.alloc(minimal_size * 12 / 10 /*add 20 %*/);
-			if (alloc.begin == nullptr) { throw std::bad_alloc(); }
-			new (new_node->buckets) sab::bucket(alloc.begin, alloc.end, new_node);
+			build_bucket(new_node->buckets, size, new_node);
 			new_node->free_buckets--;
 			return new_node->buckets;
 		}
 
 		allocation allocate(uint64_t size) {
+			return search_buckets(size, [size, lifetime = lifetime](sab::bucket<ALIGNMENT, IC> *bucket) {
+				return small_allocator_adapter(bucket, size, lifetime);
+			});
+		}
+
+		/*
+		 * Like allocate, with the size known at compile time. Refer to generic_allocator::alloc<T, N>.
+		 */
+		template<uint64_t SIZE>
+		allocation allocate_fixed() {
+			static_assert(SIZE <= LARGE_ALLOCATION_THRESHOLD, "Large allocations don't fit into the buckets");
+			return search_buckets(SIZE, [lifetime = lifetime](sab::bucket<ALIGNMENT, IC> *bucket) {
+				return small_allocator_adapter<ALIGNMENT, IC>(bucket, SIZE, lifetime);
+			});
+		}
+
+		/*
+		 * Allocation, that starts at a multiple of alignment. alignment must be a power of two.
+		 */
+		allocation allocate_aligned(uint64_t size, uint64_t alignment) {
+			if (alignment <= ALIGNMENT) { return allocate(size); }
+			// a new bucket must be large enough to contain an aligned run
+			return search_buckets(size + alignment,
+								  [size, alignment, lifetime = lifetime](sab::bucket<ALIGNMENT, IC> *bucket) {
+									  return small_allocator_aligned_adapter(bucket, size, alignment, lifetime);
+								  });
+		}
+
+		/*
+		 * Tries try_alloc on the buckets starting at the current one and constructs a new bucket,
+		 * that can hold at least minimal_size bytes, if none fits within a few buckets.
+		 */
+		template<class TRY_ALLOC>
+		allocation search_buckets(uint64_t minimal_size, TRY_ALLOC try_alloc) {
 			NodeIterator it = current_node;
 
 			int iterations_before_allocating_new_bucket = 6;
+			if constexpr (ST == STATISTICS::COUNTERS) { counters.bucket_searches++; }
 
 			while (true) {
 				sab::bucket<ALIGNMENT, IC> *bucket = it.get_current_bucket();
+				if constexpr (ST == STATISTICS::COUNTERS) { counters.bucket_scans++; }
 				if (bucket->is_initialized()) {
-					auto alloc = small_allocator_adapter(bucket, size);
+					auto alloc = try_alloc(bucket);
 					if (alloc) {
 						//std::cout << "hey!" << std::endl;
 
 						current_node = it;
+						mark_dirty(bucket);
+						if constexpr (ST == STATISTICS::COUNTERS) {
+							counters.bytes_handed_out += alloc->end - alloc->begin;
+						}
 						return *alloc;
 					}
 				}
 				it.next(&head);
 				iterations_before_allocating_new_bucket--;
 				if (iterations_before_allocating_new_bucket == 0) {
-					sab::bucket<ALIGNMENT, IC> *new_bucket = construct_new_bucket(size);
+					sab::bucket<ALIGNMENT, IC> *new_bucket = construct_new_bucket(minimal_size);
 					if constexpr (IC == INVARIANT_CHECKING::CONSTANT || IC == INVARIANT_CHECKING::FULL) {
 						if (!new_bucket->is_initialized()) { throw std::runtime_error("Bucket is not initialized"); }
 					}
-					auto alloc = small_allocator_adapter(new_bucket, size);
+					auto alloc = try_alloc(new_bucket);
 					if (alloc) {
+						// continue from the new bucket, else every following call builds yet another one
+						auto *node   = (small_allocator_node<ALIGNMENT, IC> *) new_bucket->container;
+						current_node = {node, uint64_t(new_bucket - node->buckets)};
+						mark_dirty(new_bucket);
+						if constexpr (ST == STATISTICS::COUNTERS) {
+							counters.bytes_handed_out += alloc->end - alloc->begin;
+						}
 						return *alloc;
 					} else {
 						throw std::bad_alloc();
@@ -0,0 +1,140 @@
+#ifndef CUSTOM_ALLOCATOR_TRACE_RECORDER_H
+#define CUSTOM_ALLOCATOR_TRACE_RECORDER_H
+
+#include "utils.h"
+
+#include <cstdint>
+#include <cstring>
+#include <istream>
+#include <ostream>
+#include <stdexcept>
+#include <unordered_map>
+#include <vector>
+
+namespace cau {
+	/*
+	 * Trace format:
+	 *  8 byte magic TRACE_MAGIC, followed by one LEB128 varint per event.
+	 *  The lowest bit of the varint is the kind of the event, the remaining bits the argument.
+	 *  An allocation has the size as argument. Allocations are numbered implicitly in the order they appear.
+	 *  A free has the distance to the number of the freed allocation as argument,
+	 *  so the free of the last allocation is 1. Short-lived allocations therefore encode in a single byte.
+	 */
+	constexpr char TRACE_MAGIC[8] = {'C', 'A', 'U', 'T', 'R', 'C', '0', '1'};
+
+	struct trace_event {
+		enum class KIND : uint8_t { ALLOC, FREE };
+		KIND     kind;
+		uint64_t size; // only for ALLOC
+		uint64_t id;   // number of the allocation
+	};
+
+	/**
+	 * Wrapper around an allocator with alloc(size) and dealloc(allocation), like generic_allocator,
+	 * that logs every event in the trace format to a stream.
+	 * The events are buffered and written in chunks. Call flush before reading the stream.
+	 * @tparam Allocator allocator to record
+	 */
+	template<class Allocator>
+	struct trace_recorder {
+		static constexpr uint64_t BUFFER_SIZE = 64 * 1024;
+
+		Allocator                           &allocator;
+		std::ostream                        &out;
+		std::vector<uint8_t>                 buffer;
+		std::unordered_map<void *, uint64_t> live_ids;
+		uint64_t                             allocation_count = 0;
+
+		trace_recorder(Allocator &allocator, std::ostream &out) : allocator(allocator), out(out) {
+			buffer.reserve(BUFFER_SIZE + 10);
+			out.write(TRACE_MAGIC, sizeof(TRACE_MAGIC));
+		}
+
+		trace_recorder(const trace_recorder &) = delete;
+
+		~trace_recorder() { flush(); }
+
+		void write_varint(uint64_t value) {
+			while (value >= 0x80) {
+				buffer.push_back(uint8_t(value) | 0x80);
+				value >>= 7;
+			}
+			buffer.push_back(uint8_t(value));
+			if (buffer.size() >= BUFFER_SIZE) { flush(); }
+		}
+
+		void flush() {
+			out.write((const char *) buffer.data(), std::streamsize(buffer.size()));
+			out.flush();
+			buffer.clear();
+		}
+
+		allocation alloc(size_t size) {
+			allocation a = allocator.alloc(size);
+			live_ids[a.begin] = allocation_count++;
+			write_varint(uint64_t(size) << 1);
+			return a;
+		}
+
+		template<class T>
+		T *alloc(size_t count) {
+			return (T *) alloc(sizeof(T) * count).begin;
+		}
+
+		void dealloc(allocation alloc) {
+			auto it = live_ids.find(alloc.begin);
+			if (it != live_ids.end()) {
+				write_varint(((allocation_count - it->second) << 1) | 1);
+				live_ids.erase(it);
+			}
+			allocator.dealloc(alloc);
+		}
+
+		template<class T>
+		void dealloc(T *ptr, uint64_t count) {
+			for (uint64_t i = 0; i < count; i++) { ptr[i].~T(); }
+
+			dealloc({(uint8_t *) ptr, (uint8_t *) ptr + count * sizeof(T)});
+		}
+	};
+
+	inline std::vector<trace_event> read_trace(std::istream &in) {
+		char magic[sizeof(TRACE_MAGIC)];
+		if (!in.read(magic, sizeof(magic)) || memcmp(magic, TRACE_MAGIC, sizeof(magic)) != 0) {
+			throw std::runtime_error("Not a trace");
+		}
+
+		std::vector<trace_event> events;
+		std::vector<bool>        freed; // per allocation, a replay must not free twice
+		uint64_t                 allocation_count = 0;
+		uint64_t                 value            = 0;
+		uint64_t                 shift            = 0;
+		char                     c;
+		while (in.get(c)) {
+			value |= uint64_t(uint8_t(c) & 0x7f) << shift;
+			shift += 7;
+			if (uint8_t(c) & 0x80) {
+				if (shift >= 64) { throw std::runtime_error("Corrupted trace"); }
+				continue;
+			}
+			if (value & 1) {
+				if ((value >> 1) > allocation_count || (value >> 1) == 0) {
+					throw std::runtime_error("Free of unknown allocation");
+				}
+				const uint64_t id = allocation_count - (value >> 1);
+				if (freed[id]) { throw std::runtime_error("Allocation freed twice"); }
+				freed[id] = true;
+				events.push_back({trace_event::KIND::FREE, 0, id});
+			} else {
+				events.push_back({trace_event::KIND::ALLOC, value >> 1, allocation_count++});
+				freed.push_back(false);
+			}
+			value = 0;
+			shift = 0;
+		}
+		if (shift != 0) { throw std::runtime_error("Truncated trace"); }
+		return events;
+	}
+} // namespace cau
+
+#endif //CUSTOM_ALLOCATOR_TRACE_RECORDER_H
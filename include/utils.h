@@ -7,16 +7,16 @@
 
 #include <cstdint>
 namespace cau {
-	uint64_t round_down_to_multiple(uint64_t value, uint64_t multiple) { return value - (value % multiple); }
+	constexpr uint64_t round_down_to_multiple(uint64_t value, uint64_t multiple) { return value - (value % multiple); }
 
-	uint64_t round_up_to_multiple(uint64_t value, uint64_t multiple) {
+	constexpr uint64_t round_up_to_multiple(uint64_t value, uint64_t multiple) {
 		return (value + multiple - 1) / multiple * multiple;
 	}
 
 	/*
 	 * find largest y < x such that y * M is a multiple of M + 1
      */
-	uint64_t round_down_to_multiple_plus_one(uint64_t value, uint64_t multiple) {
+	constexpr uint64_t round_down_to_multiple_plus_one(uint64_t value, uint64_t multiple) {
 		// M and M + 1 are coprime
 		return round_down_to_multiple(value, multiple + 1);
 	}
@@ -34,9 +34,33 @@ namespace cau {
 		const dealloc_func_t dealloc;
 	};
 
-	uint64_t max(uint64_t a, uint64_t b) { return a > b ? a : b; }
+	constexpr uint64_t max(uint64_t a, uint64_t b) { return a > b ? a : b; }
 
 	enum class INVARIANT_CHECKING { NONE, CONSTANT, FULL };
 
+	enum class STATISTICS { NONE, COUNTERS };
+
+	// Whether buckets and nodes record, that they changed since the last checkpoint. Only file_heap needs it.
+	enum class DIRTY_TRACKING { NONE, BUCKETS };
+
+	// Expected lifetime of an allocation, each one is served from its own set of buckets.
+	enum class LIFETIME { TEMPORARY, SESSION, PERMANENT };
+
+	// allocations above this size bypass the buckets and go straight to the wrapped allocator
+	constexpr uint64_t LARGE_ALLOCATION_THRESHOLD = 32'000;
+	// alignments from this one on are served by over-allocating from the wrapped allocator
+	constexpr uint64_t LARGE_ALIGNMENT_THRESHOLD = 4096;
+
+	/*
+	 * Whether an allocation bypasses the buckets, refer to generic_allocator::do_allocation.
+	 */
+	constexpr bool is_large_allocation(uint64_t size, uint64_t alignment) {
+		if (alignment > 64) {
+			// alignment is below the threshold here, so the subtraction can't wrap, unlike size + alignment
+			return alignment >= LARGE_ALIGNMENT_THRESHOLD || size > LARGE_ALLOCATION_THRESHOLD - alignment;
+		}
+		return size > LARGE_ALLOCATION_THRESHOLD;
+	}
+
 } // namespace cau
 #endif //CUSTOM_ALLOCATOR_UTILS_H
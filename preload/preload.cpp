@@ -0,0 +1,232 @@
+//
+// Drop-in replacement for malloc and the global operator new/delete on top of cau::generic_allocator.
+// Build it with make preload and load it into any dynamically linked program:
+//     LD_PRELOAD=./libcau_preload.so program
+// The heap is guarded by a single lock, so it's meant for measuring cau on real workloads,
+// not for heavily threaded programs.
+//
+
+#include "include/generic_unsync_alloc.h"
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <pthread.h>
+#include <sys/mman.h>
+
+// malloc can't be the wrapped allocator anymore
+constexpr cau::i_allocator mmap_allocator = {[](size_t size) -> cau::allocation {
+												 void *ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+																  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+												 if (ptr == MAP_FAILED) { return {nullptr, nullptr}; }
+												 return {(uint8_t *) ptr, (uint8_t *) ptr + size};
+											 },
+											 [](cau::allocation alloc) { munmap(alloc.begin, alloc.end - alloc.begin); }};
+
+using heap_t = cau::generic_allocator<mmap_allocator>;
+
+constexpr uint64_t PAGE_ALIGNMENT = 4096;
+
+namespace {
+	std::mutex heap_lock;
+	alignas(heap_t) unsigned char heap_storage[sizeof(heap_t)];
+	heap_t *heap = nullptr;
+
+	// The allocator throws under memory pressure and libstdc++ allocates the exception with malloc,
+	// that call must not wait for the lock held by the same thread.
+	[[gnu::tls_model("initial-exec")]] thread_local bool inside_heap = false;
+
+	// Frees from within the heap, they are passed on once the heap is consistent again. The list is linked through
+	// the first word of the freed allocations, so it never runs out of room.
+	[[gnu::tls_model("initial-exec")]] thread_local void *deferred_frees = nullptr;
+
+	struct heap_guard {
+		std::lock_guard<std::mutex> lock{heap_lock};
+
+		heap_guard() {
+			inside_heap = true;
+			// Never destroyed, frees can still come in from destructors of static objects.
+			if (heap == nullptr) { heap = new (heap_storage) heap_t{}; }
+		}
+
+		~heap_guard() {
+			// still holding the lock, frees coming in meanwhile are deferred again and drained by this loop
+			while (deferred_frees != nullptr) {
+				void *ptr      = deferred_frees;
+				deferred_frees = *(void **) ptr;
+				heap->dealloc(ptr);
+			}
+			inside_heap = false;
+		}
+	};
+
+	void defer_free(void *ptr) {
+		*(void **) ptr = deferred_frees;
+		deferred_frees = ptr;
+	}
+
+	void *allocate(size_t size) {
+		if (inside_heap) { return nullptr; }
+		heap_guard guard;
+		try {
+			return heap->alloc(size == 0 ? 1 : size).begin;
+		} catch (...) { return nullptr; }
+	}
+
+	void *allocate_aligned(size_t alignment, size_t size) {
+		if (inside_heap) { return nullptr; }
+		heap_guard guard;
+		try {
+			return heap->alloc_aligned(size == 0 ? 1 : size, alignment).begin;
+		} catch (...) { return nullptr; }
+	}
+
+	void deallocate(void *ptr) {
+		if (ptr == nullptr) { return; }
+		if (inside_heap) {
+			defer_free(ptr);
+			return;
+		}
+		heap_guard guard;
+		heap->dealloc(ptr);
+	}
+
+	// size and alignment as passed to operator new, which the sized operator delete guarantees
+	void deallocate_sized(void *ptr, size_t size, size_t alignment = 64) {
+		if (ptr == nullptr) { return; }
+		if (inside_heap) {
+			defer_free(ptr);
+			return;
+		}
+		heap_guard guard;
+		heap->dealloc_sized(ptr, size == 0 ? 1 : size, cau::max(alignment, 64));
+	}
+
+	size_t usable_size(void *ptr) {
+		if (ptr == nullptr || inside_heap) { return 0; }
+		heap_guard guard;
+		return heap->usable_size(ptr);
+	}
+
+	void *allocate_or_throw(size_t size, size_t alignment = 64) {
+		while (true) {
+			void *ptr = allocate_aligned(alignment, size);
+			if (ptr != nullptr) { return ptr; }
+			std::new_handler handler = std::get_new_handler();
+			if (handler == nullptr) { throw std::bad_alloc(); }
+			handler();
+		}
+	}
+
+	bool is_valid_alignment(size_t alignment) { return alignment != 0 && (alignment & (alignment - 1)) == 0; }
+
+	[[gnu::constructor]] void register_fork_handlers() {
+		// keep the heap consistent in the child, if another thread allocates during fork
+		pthread_atfork([] { heap_lock.lock(); }, [] { heap_lock.unlock(); }, [] { heap_lock.unlock(); });
+	}
+} // namespace
+
+extern "C" {
+void *malloc(size_t size) noexcept {
+	void *ptr = allocate(size);
+	if (ptr == nullptr) { errno = ENOMEM; }
+	return ptr;
+}
+
+void free(void *ptr) noexcept { deallocate(ptr); }
+
+void *calloc(size_t count, size_t size) noexcept {
+	size_t total;
+	if (__builtin_mul_overflow(count, size, &total)) {
+		errno = ENOMEM;
+		return nullptr;
+	}
+	void *ptr = malloc(total);
+	if (ptr != nullptr) { memset(ptr, 0, total); }
+	return ptr;
+}
+
+void *realloc(void *ptr, size_t size) noexcept {
+	if (ptr == nullptr) { return malloc(size); }
+	if (size == 0) {
+		free(ptr);
+		return nullptr;
+	}
+	const size_t old_size = usable_size(ptr);
+	if (size <= old_size) { return ptr; }
+	void *new_ptr = malloc(size);
+	if (new_ptr == nullptr) { return nullptr; }
+	memcpy(new_ptr, ptr, old_size);
+	free(ptr);
+	return new_ptr;
+}
+
+void *reallocarray(void *ptr, size_t count, size_t size) noexcept {
+	size_t total;
+	if (__builtin_mul_overflow(count, size, &total)) {
+		errno = ENOMEM;
+		return nullptr;
+	}
+	return realloc(ptr, total);
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size) noexcept {
+	if (!is_valid_alignment(alignment) || alignment % sizeof(void *) != 0) { return EINVAL; }
+	void *ptr = allocate_aligned(alignment, size);
+	if (ptr == nullptr) { return ENOMEM; }
+	*memptr = ptr;
+	return 0;
+}
+
+void *aligned_alloc(size_t alignment, size_t size) noexcept {
+	if (!is_valid_alignment(alignment)) {
+		errno = EINVAL;
+		return nullptr;
+	}
+	void *ptr = allocate_aligned(alignment, size);
+	if (ptr == nullptr) { errno = ENOMEM; }
+	return ptr;
+}
+
+void *memalign(size_t alignment, size_t size) noexcept { return aligned_alloc(alignment, size); }
+
+void *valloc(size_t size) noexcept { return aligned_alloc(PAGE_ALIGNMENT, size); }
+
+void *pvalloc(size_t size) noexcept {
+	return aligned_alloc(PAGE_ALIGNMENT, cau::round_up_to_multiple(size, PAGE_ALIGNMENT));
+}
+
+size_t malloc_usable_size(void *ptr) noexcept { return usable_size(ptr); }
+}
+
+void *operator new(size_t size) { return allocate_or_throw(size); }
+void *operator new[](size_t size) { return allocate_or_throw(size); }
+void *operator new(size_t size, const std::nothrow_t &) noexcept { return allocate(size); }
+void *operator new[](size_t size, const std::nothrow_t &) noexcept { return allocate(size); }
+void *operator new(size_t size, std::align_val_t alignment) { return allocate_or_throw(size, size_t(alignment)); }
+void *operator new[](size_t size, std::align_val_t alignment) { return allocate_or_throw(size, size_t(alignment)); }
+void *operator new(size_t size, std::align_val_t alignment, const std::nothrow_t &) noexcept {
+	return allocate_aligned(size_t(alignment), size);
+}
+void *operator new[](size_t size, std::align_val_t alignment, const std::nothrow_t &) noexcept {
+	return allocate_aligned(size_t(alignment), size);
+}
+
+void operator delete(void *ptr) noexcept { deallocate(ptr); }
+void operator delete[](void *ptr) noexcept { deallocate(ptr); }
+void operator delete(void *ptr, size_t size) noexcept { deallocate_sized(ptr, size); }
+void operator delete[](void *ptr, size_t size) noexcept { deallocate_sized(ptr, size); }
+void operator delete(void *ptr, const std::nothrow_t &) noexcept { deallocate(ptr); }
+void operator delete[](void *ptr, const std::nothrow_t &) noexcept { deallocate(ptr); }
+void operator delete(void *ptr, std::align_val_t) noexcept { deallocate(ptr); }
+void operator delete[](void *ptr, std::align_val_t) noexcept { deallocate(ptr); }
+void operator delete(void *ptr, size_t size, std::align_val_t alignment) noexcept {
+	deallocate_sized(ptr, size, size_t(alignment));
+}
+void operator delete[](void *ptr, size_t size, std::align_val_t alignment) noexcept {
+	deallocate_sized(ptr, size, size_t(alignment));
+}
+void operator delete(void *ptr, std::align_val_t, const std::nothrow_t &) noexcept { deallocate(ptr); }
+void operator delete[](void *ptr, std::align_val_t, const std::nothrow_t &) noexcept { deallocate(ptr); }
@@ -0,0 +1,151 @@
+//
+// Runs under the preload shim, refer to make preload.
+// Several threads allocate and free through every entry point at once, then the address space is limited, so the heap
+// fails inside and libstdc++ allocates its exceptions with malloc from within the heap.
+//
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <malloc.h>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <sys/resource.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+int run_thread(uint64_t seed) {
+	constexpr uint64_t SLOTS = 256;
+	void              *slots[SLOTS]{};
+	uint64_t           sizes[SLOTS]{};
+
+	uint64_t state = seed;
+	for (uint64_t i = 0; i < 200'000; i++) {
+		state                = state * 6364136223846793005 + 1442695040888963407;
+		const uint64_t slot  = (state >> 33) % SLOTS;
+		const uint64_t size  = (state >> 13) % 64 == 0 ? 40'000 + (state >> 20) % 100'000 : (state >> 20) % 2000;
+		const uint8_t  value = uint8_t(slot);
+		if (slots[slot] != nullptr) {
+			for (uint64_t j = 0; j < sizes[slot]; j += 61) {
+				if (((uint8_t *) slots[slot])[j] != value) {
+					std::cout << "ERROR: allocation was overwritten" << std::endl;
+					return 1;
+				}
+			}
+			if (i % 3 == 0) {
+				void *grown = realloc(slots[slot], sizes[slot] + size);
+				if (grown == nullptr) { return 1; }
+				memset(grown, value, sizes[slot] + size);
+				slots[slot] = grown;
+				sizes[slot] += size;
+				continue;
+			}
+			free(slots[slot]);
+			slots[slot] = nullptr;
+			continue;
+		}
+		switch (i % 4) {
+			case 0: slots[slot] = malloc(size); break;
+			case 1: slots[slot] = calloc(1, size); break;
+			case 2: slots[slot] = aligned_alloc(4096, size); break;
+			default:
+				if (posix_memalign(&slots[slot], 128, size) != 0) { slots[slot] = nullptr; }
+				break;
+		}
+		if (slots[slot] == nullptr || malloc_usable_size(slots[slot]) < size) {
+			std::cout << "ERROR: allocation of " << size << " bytes failed" << std::endl;
+			return 1;
+		}
+		memset(slots[slot], value, size);
+		sizes[slot] = size;
+
+		// exceptions and containers take the operator new path
+		if (i % 1000 == 0) {
+			try {
+				throw std::runtime_error(std::string(100, 'x'));
+			} catch (const std::runtime_error &e) {
+				if (strlen(e.what()) != 100) { return 1; }
+			}
+			std::vector<std::string> strings(100, std::string(50, 'y'));
+		}
+	}
+	for (void *ptr: slots) { free(ptr); }
+	return 0;
+}
+
+uint64_t address_space() {
+	std::ifstream statm("/proc/self/statm");
+	uint64_t      pages = 0;
+	statm >> pages;
+	return pages * uint64_t(sysconf(_SC_PAGESIZE));
+}
+
+int test_out_of_memory() {
+	rlimit old_limit{};
+	getrlimit(RLIMIT_AS, &old_limit);
+	rlimit limit = old_limit;
+	limit.rlim_cur = address_space() + (64 << 20);
+	if (setrlimit(RLIMIT_AS, &limit) != 0) { return 0; }
+
+	std::vector<void *> kept;
+	kept.reserve(1'000'000);
+	uint64_t failures = 0;
+	for (uint64_t i = 0; i < 1'000'000 && failures < 100; i++) {
+		void *ptr = malloc(i % 10 == 0 ? 100'000 : 1000);
+		if (ptr == nullptr) {
+			failures++;
+			continue;
+		}
+		memset(ptr, 1, 1000);
+		kept.push_back(ptr);
+	}
+	bool threw = false;
+	try {
+		kept.push_back(new char[1'000'000'000]);
+	} catch (const std::bad_alloc &) { threw = true; }
+	for (void *ptr: kept) { free(ptr); }
+	setrlimit(RLIMIT_AS, &old_limit);
+
+	if (failures == 0 || !threw) {
+		std::cout << "ERROR: allocations didn't fail under the limit" << std::endl;
+		return 1;
+	}
+	// the heap must still be usable
+	void *ptr = malloc(1000);
+	if (ptr == nullptr) {
+		std::cout << "ERROR: heap unusable after running out of memory" << std::endl;
+		return 1;
+	}
+	free(ptr);
+	return 0;
+}
+
+// size + alignment wraps around in the heap, out of line, so the compiler doesn't reject the size
+[[gnu::noinline]] int test_aligned_overflow(size_t size) {
+	if (aligned_alloc(4096, size) != nullptr || aligned_alloc(128, size) != nullptr) {
+		std::cout << "ERROR: aligned allocation of almost SIZE_MAX bytes succeeded" << std::endl;
+		return 1;
+	}
+	return 0;
+}
+
+int main() {
+	std::vector<std::thread> threads;
+	int                      results[4]{};
+	for (uint64_t t = 0; t < 4; t++) {
+		threads.emplace_back([t, &results] { results[t] = run_thread(t + 1); });
+	}
+	for (auto &thread: threads) { thread.join(); }
+	for (int result: results) {
+		if (result != 0) { return 1; }
+	}
+
+	if (test_aligned_overflow(SIZE_MAX - 100)) { return 1; }
+	if (test_out_of_memory()) { return 1; }
+	std::cout << "preload test passed" << std::endl;
+	return 0;
+}
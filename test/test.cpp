@@ -3,13 +3,23 @@
 //
 
 
+#include <chrono>
 #include <list>
+#include <sstream>
 #include <string>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
 #include <unordered_map>
 #include <unordered_set>
 #include <vector>
 
+#include "include/bucket_maintainer.h"
+#include "include/file_heap.h"
 #include "include/generic_unsync_alloc.h"
+#include "include/handle_allocator.h"
+#include "include/shared_heap.h"
+#include "include/trace_recorder.h"
 
 using string_type = std::basic_string<char, std::char_traits<char>, cau::STD_allocator<char>>;
 
@@ -24,6 +34,682 @@ using Set    = std::unordered_set<int, std::hash<int>, std::equal_to<>, cau::STD
 
 cau::generic_allocator<cau::default_allocator> *cau::global_file_allocator;
 
+int test_stats() {
+	cau::generic_allocator<cau::default_allocator, cau::INVARIANT_CHECKING::CONSTANT, cau::STATISTICS::COUNTERS> alloc;
+
+	// the set of large allocations keeps its bucket array, so warm it up before taking the baseline
+	alloc.dealloc(alloc.alloc(100'000));
+	const cau::allocator_stats baseline = alloc.stats();
+
+	std::vector<cau::allocation> allocations;
+	for (uint64_t i = 0; i < 1000; i++) { allocations.push_back(alloc.alloc(1 + (i * 97) % 2000)); }
+	allocations.push_back(alloc.alloc(100'000));
+
+	cau::allocator_stats stats = alloc.stats();
+	if (stats.total_allocations() - baseline.total_allocations() != 1001 ||
+		stats.allocations[cau::allocator_stats::LARGE_SIZE_CLASS] != 2) {
+		std::cout << "ERROR: allocation count " << stats.total_allocations() << std::endl;
+		return 1;
+	}
+	if (stats.allocations[0] == 0 || stats.buckets_created == 0 || stats.large_bytes != 100'000) {
+		std::cout << "ERROR: size classes or buckets not recorded" << std::endl;
+		return 1;
+	}
+	if (stats.bytes_reserved < stats.bytes_handed_out || stats.fragmentation() <= 0.0 ||
+		stats.bucket_scans < stats.bucket_searches) {
+		std::cout << "ERROR: inconsistent byte counters" << std::endl;
+		return 1;
+	}
+
+	for (auto a: allocations) { alloc.dealloc(a); }
+
+	stats = alloc.stats();
+	if (stats.total_deallocations() != stats.total_allocations() ||
+		stats.bytes_handed_out != baseline.bytes_handed_out || stats.large_bytes != 0) {
+		std::cout << "ERROR: deallocation count " << stats.total_deallocations() << std::endl;
+		return 1;
+	}
+	if (stats.bytes_reserved != baseline.bytes_reserved || stats.peak_bytes_reserved <= stats.bytes_reserved) {
+		std::cout << "ERROR: memory was not released " << stats.bytes_reserved << std::endl;
+		return 1;
+	}
+	return 0;
+}
+
+int test_lifetime_hints() {
+	cau::generic_allocator<cau::default_allocator, cau::INVARIANT_CHECKING::FULL, cau::STATISTICS::COUNTERS> alloc;
+
+	// long-lived cache entries, made while serving requests full of temporaries
+	std::vector<cau::allocation> cache;
+	for (uint64_t request = 0; request < 100; request++) {
+		std::vector<cau::allocation> temporaries;
+		for (uint64_t i = 0; i < 50; i++) { temporaries.push_back(alloc.alloc(64 + i * 8)); }
+		cache.push_back(alloc.alloc(200, cau::LIFETIME::PERMANENT));
+		for (auto a: temporaries) { alloc.dealloc(a); }
+	}
+	const cau::allocator_stats &temporary = alloc.small_allocator.stats();
+	if (temporary.bytes_handed_out != 0 || temporary.buckets_created != temporary.buckets_destroyed) {
+		std::cout << "ERROR: temporary buckets did not drain" << std::endl;
+		return 1;
+	}
+	const cau::allocator_stats &permanent = alloc.permanent_allocator.stats();
+	if (permanent.bytes_handed_out == 0 ||
+		alloc.small_allocator.lifetime_of(cache[0].begin) != cau::LIFETIME::PERMANENT) {
+		std::cout << "ERROR: hinted allocations not in their own buckets" << std::endl;
+		return 1;
+	}
+	for (auto a: cache) { alloc.dealloc(a); }
+	if (permanent.bytes_handed_out != 0 || permanent.buckets_created != permanent.buckets_destroyed) {
+		std::cout << "ERROR: permanent allocations not returned to their buckets" << std::endl;
+		return 1;
+	}
+	// the traffic is counted by the allocator serving it
+	if (temporary.total_allocations() != 5000 || permanent.total_allocations() != 100 ||
+		permanent.total_deallocations() != 100 || alloc.session_allocator.stats().total_allocations() != 0) {
+		std::cout << "ERROR: counters not attributed to the serving allocator" << std::endl;
+		return 1;
+	}
+
+	cau::generic_allocator<cau::default_allocator> plain;
+	cau::global_file_allocator = &plain;
+	{
+		std::vector<int, cau::STD_session_allocator<int>> v;
+		for (int i = 0; i < 1000; i++) { v.push_back(i); }
+		if (plain.small_allocator.lifetime_of(v.data()) != cau::LIFETIME::SESSION) {
+			std::cout << "ERROR: STD_session_allocator ignored the hint" << std::endl;
+			return 1;
+		}
+	}
+	cau::global_file_allocator = nullptr;
+	return 0;
+}
+
+int test_handle_allocator() {
+	cau::handle_allocator<cau::default_allocator, cau::INVARIANT_CHECKING::FULL> alloc;
+
+	std::vector<cau::handle> handles;
+	for (uint64_t i = 0; i < 20'000; i++) {
+		handles.push_back(alloc.alloc(100));
+		*alloc.get<uint64_t>(handles.back()) = i;
+	}
+	cau::handle large = alloc.alloc(100'000);
+	// a cache, that evicted most of its entries
+	for (uint64_t i = 0; i < handles.size(); i++) {
+		if (i % 8 != 0) { alloc.free(handles[i]); }
+	}
+	try {
+		alloc.free(handles[1]);
+		std::cout << "ERROR: stale handle not detected" << std::endl;
+		return 1;
+	} catch (const std::runtime_error &) {}
+
+	const uint64_t before = alloc.bucket_count();
+	for (uint64_t step = 0; step < 100; step++) {
+		// the budget bounds the scanning as well as the moves
+		const uint64_t work = alloc.scan_work;
+		if (alloc.compact_step(500) > 500 || alloc.scan_work - work > 500) {
+			std::cout << "ERROR: compact_step exceeded its budget " << alloc.scan_work - work << std::endl;
+			return 1;
+		}
+	}
+	const uint64_t after_steps = alloc.bucket_count();
+	alloc.compact();
+	if (!(after_steps < before && alloc.bucket_count() < before / 4) || alloc.blocks_moved == 0) {
+		std::cout << "ERROR: compaction freed too few buckets " << before << " -> " << after_steps << " -> "
+				  << alloc.bucket_count() << std::endl;
+		return 1;
+	}
+	for (uint64_t i = 0; i < handles.size(); i += 8) {
+		if (*alloc.get<uint64_t>(handles[i]) != i) {
+			std::cout << "ERROR: moved block lost its content " << i << std::endl;
+			return 1;
+		}
+		alloc.free(handles[i]);
+	}
+	alloc.free(large);
+	if (alloc.bucket_count() != 0) {
+		std::cout << "ERROR: buckets left after freeing everything" << std::endl;
+		return 1;
+	}
+	return 0;
+}
+
+// drops itself and the line it's called from, so all calls from one test share a call site
+[[gnu::noinline]] void record_sample(cau::heap_profiler &profiler, void *ptr, uint64_t size) {
+	profiler.record_alloc(ptr, size, 2);
+}
+
+int test_heap_profiler() {
+	cau::generic_allocator<cau::default_allocator> alloc;
+	cau::heap_profiler                            profiler(4096);
+	alloc.set_profiler(&profiler);
+
+	std::vector<cau::allocation> allocations;
+	for (uint64_t i = 0; i < 1000; i++) { allocations.push_back(alloc.alloc(64 + i % 512)); }
+	allocations.push_back(alloc.alloc(100'000));
+
+	// roughly 440 KB were requested, so about a hundred samples are expected
+	if (profiler.total_samples < 20 || profiler.live_sampled_bytes == 0 || profiler.call_sites.empty()) {
+		std::cout << "ERROR: too few samples " << profiler.total_samples << std::endl;
+		return 1;
+	}
+
+	std::stringstream folded;
+	profiler.write_folded(folded);
+	std::stringstream pprof;
+	profiler.write_pprof(pprof);
+	if (folded.str().empty() || pprof.str().find("@ heap_v2/4096") == std::string::npos) {
+		std::cout << "ERROR: empty profile" << std::endl;
+		return 1;
+	}
+
+	for (auto a: allocations) { alloc.dealloc(a); }
+	if (profiler.live_sampled_bytes != 0 || !profiler.live_samples.empty()) {
+		std::cout << "ERROR: sampled allocations still live " << profiler.live_sampled_bytes << std::endl;
+		return 1;
+	}
+	alloc.set_profiler(nullptr);
+
+	// a site with mixed sizes, each sample counts with its own weight and not with the one of the average size
+	cau::heap_profiler mixed(4096);
+	uint64_t           slots[2];
+	record_sample(mixed, &slots[0], 64);
+	record_sample(mixed, &slots[1], 1'000'000);
+	std::stringstream mixed_folded;
+	mixed.write_folded(mixed_folded);
+	const uint64_t expected = uint64_t(mixed.unsample(64) + mixed.unsample(1'000'000));
+	if (mixed.call_sites.size() != 1 || !mixed_folded.str().ends_with(' ' + std::to_string(expected) + '\n')) {
+		std::cout << "ERROR: mixed site weighted wrong " << mixed_folded.str() << std::endl;
+		return 1;
+	}
+	return 0;
+}
+
+int test_trace_recorder() {
+	cau::generic_allocator<cau::default_allocator> alloc;
+	std::stringstream                              trace;
+	{
+		cau::trace_recorder recorder(alloc, trace);
+		auto                a = recorder.alloc(10);
+		auto                b = recorder.alloc(1'000'000);
+		recorder.dealloc(a);
+		auto c = recorder.alloc(200);
+		recorder.dealloc(c);
+		recorder.dealloc(b);
+	}
+
+	auto events = cau::read_trace(trace);
+	using KIND  = cau::trace_event::KIND;
+	const cau::trace_event expected[] = {
+			{KIND::ALLOC, 10, 0}, {KIND::ALLOC, 1'000'000, 1}, {KIND::FREE, 0, 0},
+			{KIND::ALLOC, 200, 2}, {KIND::FREE, 0, 2},         {KIND::FREE, 0, 1},
+	};
+	if (events.size() != std::size(expected)) {
+		std::cout << "ERROR: trace has " << events.size() << " events" << std::endl;
+		return 1;
+	}
+	for (uint64_t i = 0; i < events.size(); i++) {
+		if (events[i].kind != expected[i].kind || events[i].size != expected[i].size ||
+			events[i].id != expected[i].id) {
+			std::cout << "ERROR: event " << i << " differs" << std::endl;
+			return 1;
+		}
+	}
+
+	// alloc(10) followed by two frees of it
+	std::stringstream double_free(std::string(cau::TRACE_MAGIC, sizeof(cau::TRACE_MAGIC)) + "\x14\x03\x03");
+	try {
+		cau::read_trace(double_free);
+		std::cout << "ERROR: trace with a double free accepted" << std::endl;
+		return 1;
+	} catch (const std::runtime_error &) {}
+	return 0;
+}
+
+// wrapped allocator, that fails every large request like an exhausted mmap
+constexpr cau::i_allocator small_only_allocator = {[](size_t size) -> cau::allocation {
+													   if (size > 1'000'000) { return {nullptr, nullptr}; }
+													   auto *ptr = (uint8_t *) malloc(size);
+													   return {ptr, ptr + size};
+												   },
+												   [](cau::allocation alloc) { free(alloc.begin); }};
+
+int test_failed_large_allocation() {
+	cau::generic_allocator<small_only_allocator, cau::INVARIANT_CHECKING::CONSTANT, cau::STATISTICS::COUNTERS> alloc;
+
+	if (alloc.alloc(2'000'000).begin != nullptr) {
+		std::cout << "ERROR: failed large allocation returned memory" << std::endl;
+		return 1;
+	}
+	if (!alloc.large_allocations.empty() || alloc.stats().large_bytes != 0 || alloc.stats().bytes_reserved != 0) {
+		std::cout << "ERROR: failed large allocation was recorded" << std::endl;
+		return 1;
+	}
+	// size + alignment wraps around
+	if (alloc.alloc_aligned(2'000'000, 4096).begin != nullptr ||
+		alloc.alloc_aligned(SIZE_MAX - 100, 4096).begin != nullptr ||
+		alloc.alloc_aligned(SIZE_MAX - 100, 128).begin != nullptr) {
+		std::cout << "ERROR: failed aligned allocation returned memory" << std::endl;
+		return 1;
+	}
+	if (!alloc.large_allocations.empty() || alloc.stats().bytes_reserved != 0) {
+		std::cout << "ERROR: failed aligned allocation was recorded" << std::endl;
+		return 1;
+	}
+	return 0;
+}
+
+int test_unsized_dealloc() {
+	cau::generic_allocator<cau::default_allocator, cau::INVARIANT_CHECKING::CONSTANT, cau::STATISTICS::COUNTERS> alloc;
+
+	void *small = alloc.alloc(100).begin;
+	void *large = alloc.alloc(100'000).begin;
+	if (alloc.usable_size(small) != 128 || alloc.usable_size(large) != 100'000) {
+		std::cout << "ERROR: usable size " << alloc.usable_size(small) << " " << alloc.usable_size(large) << std::endl;
+		return 1;
+	}
+	alloc.dealloc(small);
+	alloc.dealloc(large);
+
+	const cau::allocator_stats stats = alloc.stats();
+	if (stats.large_bytes != 0 || stats.buckets_created != stats.buckets_destroyed + 1) {
+		std::cout << "ERROR: unsized dealloc didn't release memory" << std::endl;
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Buckets above 32 KB have a free list of more than one slot. Its bytes must not count as free slots, else the bucket
+ * never empties again.
+ */
+int test_large_bucket() {
+	cau::generic_allocator<cau::default_allocator, cau::INVARIANT_CHECKING::CONSTANT, cau::STATISTICS::COUNTERS> alloc;
+
+	try {
+		const cau::allocation a = alloc.alloc(cau::LARGE_ALLOCATION_THRESHOLD);
+		const cau::allocation b = alloc.alloc(1000);
+		alloc.dealloc(b);
+		alloc.dealloc(a);
+	} catch (const std::runtime_error &e) {
+		std::cout << "ERROR: large bucket " << e.what() << std::endl;
+		return 1;
+	}
+	const cau::allocator_stats stats = alloc.stats();
+	if (stats.buckets_created == 0 || stats.buckets_destroyed != stats.buckets_created) {
+		std::cout << "ERROR: large bucket was not released " << stats.buckets_destroyed << " of "
+				  << stats.buckets_created << std::endl;
+		return 1;
+	}
+	return 0;
+}
+
+int test_sized_dealloc() {
+	cau::generic_allocator<cau::default_allocator, cau::INVARIANT_CHECKING::CONSTANT, cau::STATISTICS::COUNTERS> alloc;
+
+	std::vector<std::pair<void *, size_t>> allocations;
+	for (size_t i = 0; i < 2000; i++) {
+		const size_t        size     = (i * 7919) % 3000;
+		const cau::LIFETIME lifetime = i % 5 == 0 ? cau::LIFETIME::SESSION : cau::LIFETIME::TEMPORARY;
+		allocations.emplace_back(alloc.alloc(size, lifetime).begin, size);
+	}
+	allocations.emplace_back(alloc.alloc(100'000).begin, 100'000);
+
+	try {
+		alloc.dealloc_sized(allocations[1].first, allocations[1].second + 64);
+		std::cout << "ERROR: sized dealloc with the wrong size didn't throw" << std::endl;
+		return 1;
+	} catch (const std::runtime_error &) {}
+
+	// every other one first, so the frees hit the current bucket as well as the header
+	for (size_t first: {0, 1}) {
+		for (size_t i = first; i < allocations.size(); i += 2) {
+			alloc.dealloc_sized(allocations[i].first, allocations[i].second);
+		}
+	}
+
+	// a long run straight from the small allocator
+	cau::allocation run = alloc.small_allocator.allocate(5'000'000);
+	if (alloc.usable_size(run.begin) != 5'000'000) {
+		std::cout << "ERROR: usable size of a long run " << alloc.usable_size(run.begin) << std::endl;
+		return 1;
+	}
+	alloc.small_allocator.dealloc_sized(run);
+
+	const cau::allocator_stats stats = alloc.stats();
+	if (stats.total_deallocations() != allocations.size() || stats.large_bytes != 0 ||
+		stats.buckets_created != stats.buckets_destroyed + 1) {
+		std::cout << "ERROR: sized dealloc didn't release memory" << std::endl;
+		return 1;
+	}
+
+	// dealloc(T *, count) trusts the count as well, only the checks catch a wrong one
+	auto *values = alloc.alloc<uint64_t>(100);
+	try {
+		alloc.dealloc(values, 1);
+		std::cout << "ERROR: dealloc with a wrong count didn't throw" << std::endl;
+		return 1;
+	} catch (const std::runtime_error &) {}
+	alloc.dealloc(values, 100);
+	return 0;
+}
+
+/*
+ * After the last node was freed, the cursor sits on the full node before it. A bucket built further away, here in the
+ * holes of the first node, must become the cursor, else every following allocation builds another bucket.
+ */
+int test_bucket_cursor() {
+	cau::generic_allocator<cau::default_allocator, cau::INVARIANT_CHECKING::CONSTANT, cau::STATISTICS::COUNTERS> alloc;
+	constexpr uint64_t NODE_BUCKETS = cau::small_allocator_node<>::BUCKET_COUNT;
+	constexpr uint64_t HOLES_BEGIN  = 10;
+	constexpr uint64_t HOLES_END    = 60;
+
+	// the buckets fill up one after another, so allocations[i] lives in the bucket built i-th
+	std::vector<std::vector<cau::allocation>> allocations(2 * NODE_BUCKETS + 1);
+	while (alloc.stats().buckets_created <= 2 * NODE_BUCKETS) {
+		const cau::allocation a = alloc.alloc(100);
+		allocations[alloc.stats().buckets_created - 1].push_back(a);
+	}
+	for (auto a: allocations[2 * NODE_BUCKETS]) { alloc.dealloc(a); }
+	for (uint64_t i = HOLES_BEGIN; i < HOLES_END; i++) {
+		for (auto a: allocations[i]) { alloc.dealloc(a); }
+	}
+	if (alloc.stats().nodes_destroyed != 1 || alloc.stats().buckets_destroyed != 1 + HOLES_END - HOLES_BEGIN) {
+		std::cout << "ERROR: third node or buckets in the first node were not freed" << std::endl;
+		return 1;
+	}
+
+	const uint64_t per_bucket = allocations[0].size();
+	const uint64_t buckets    = alloc.stats().buckets_created;
+	std::vector<cau::allocation> more;
+	for (uint64_t i = 0; i < 1000; i++) { more.push_back(alloc.alloc(100)); }
+	if (alloc.stats().buckets_created - buckets > 1000 / per_bucket + 2) {
+		std::cout << "ERROR: stale bucket cursor built " << alloc.stats().buckets_created - buckets << " buckets"
+				  << std::endl;
+		return 1;
+	}
+	for (uint64_t i = 0; i < 2 * NODE_BUCKETS; i++) {
+		if (i >= HOLES_BEGIN && i < HOLES_END) { continue; }
+		for (auto a: allocations[i]) { alloc.dealloc(a); }
+	}
+	for (auto a: more) { alloc.dealloc(a); }
+	return 0;
+}
+
+int test_fixed_size_allocation() {
+	static_assert(cau::round_up_to_multiple(100, 64) == 128);
+	static_assert(!cau::is_large_allocation(32'000, 64) && cau::is_large_allocation(30'000, 4096));
+
+	struct alignas(128) Line {
+		uint64_t values[16];
+	};
+
+	cau::generic_allocator<cau::default_allocator, cau::INVARIANT_CHECKING::CONSTANT, cau::STATISTICS::COUNTERS> alloc;
+
+	uint64_t *small = alloc.alloc<uint64_t, 40>();
+	uint64_t *large = alloc.alloc<uint64_t, 10'000>();
+	Line     *lines = alloc.alloc<Line, 4>();
+	small[39]           = 1;
+	large[9999]         = 2;
+	lines[3].values[15] = 3;
+	if (alloc.usable_size(small) != 320 || alloc.usable_size(large) != 80'000 || uint64_t(lines) % 128 != 0) {
+		std::cout << "ERROR: fixed size allocation " << alloc.usable_size(small) << " " << alloc.usable_size(large)
+				  << std::endl;
+		return 1;
+	}
+	alloc.dealloc<uint64_t, 40>(small);
+	alloc.dealloc<uint64_t, 10'000>(large);
+	alloc.dealloc<Line, 4>(lines);
+
+	uint64_t *kept = alloc.alloc<uint64_t, 8>(cau::LIFETIME::PERMANENT);
+	if (alloc.small_allocator.lifetime_of(kept) != cau::LIFETIME::PERMANENT) {
+		std::cout << "ERROR: fixed size allocation ignored the lifetime" << std::endl;
+		return 1;
+	}
+	alloc.dealloc<uint64_t, 8>(kept);
+
+	const cau::allocator_stats stats = alloc.stats();
+	if (stats.allocations[cau::allocator_stats::LARGE_SIZE_CLASS] != 1 || stats.total_deallocations() != 4 ||
+		stats.large_bytes != 0 || stats.buckets_created != stats.buckets_destroyed + 1) {
+		std::cout << "ERROR: fixed size dealloc didn't release memory" << std::endl;
+		return 1;
+	}
+	return 0;
+}
+
+int test_aligned_allocation() {
+	cau::generic_allocator<cau::default_allocator, cau::INVARIANT_CHECKING::CONSTANT, cau::STATISTICS::COUNTERS> alloc;
+
+	std::vector<cau::allocation> allocations;
+	for (uint64_t alignment: {64, 128, 256, 1024, 4096, 2 * 1024 * 1024}) {
+		for (uint64_t size: {1, 100, 1000, 20'000, 100'000}) {
+			cau::allocation a = alloc.alloc_aligned(size, alignment);
+			if (uint64_t(a.begin) % alignment != 0 || uint64_t(a.end - a.begin) < size) {
+				std::cout << "ERROR: " << size << " bytes not aligned to " << alignment << std::endl;
+				return 1;
+			}
+			memset(a.begin, 0xff, size);
+			allocations.push_back(a);
+		}
+	}
+	for (auto a: allocations) { alloc.dealloc(a); }
+
+	const cau::allocator_stats stats = alloc.stats();
+	if (stats.large_bytes != 0 || stats.buckets_created != stats.buckets_destroyed + 1) {
+		std::cout << "ERROR: aligned allocations weren't released" << std::endl;
+		return 1;
+	}
+
+	using AlignedVector = std::vector<char, cau::STD_aligned_allocator<char, 128>>;
+	AlignedVector vec(1000, 'a');
+	if (uint64_t(vec.data()) % 128 != 0) {
+		std::cout << "ERROR: vector isn't aligned" << std::endl;
+		return 1;
+	}
+	return 0;
+}
+
+int test_bucket_maintainer() {
+	using Allocator =
+			cau::generic_allocator<cau::default_allocator, cau::INVARIANT_CHECKING::CONSTANT, cau::STATISTICS::COUNTERS>;
+	// declared first, so it outlives the allocator
+	cau::bucket_maintainer maintainer(cau::default_allocator, Allocator::small_allocator_t::bucket_allocation_size(0), 4,
+									  std::chrono::microseconds(100));
+	Allocator              alloc;
+	alloc.set_maintainer(&maintainer);
+
+	for (uint64_t round = 0; round < 20; round++) {
+		std::vector<cau::allocation> allocations;
+		for (uint64_t i = 0; i < 500; i++) {
+			cau::allocation a = alloc.alloc(64 + (i * 31) % 1000);
+			memset(a.begin, 0xab, a.end - a.begin);
+			allocations.push_back(a);
+		}
+		for (auto a: allocations) { alloc.dealloc(a); }
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+
+	const cau::allocator_stats stats = alloc.stats();
+	if (maintainer.buckets_taken == 0 || stats.buckets_created != stats.buckets_destroyed) {
+		std::cout << "ERROR: maintainer didn't provide buckets " << maintainer.buckets_taken << std::endl;
+		return 1;
+	}
+	return 0;
+}
+
+int test_shared_heap() {
+	using Heap             = cau::shared_heap<64, cau::INVARIANT_CHECKING::FULL>;
+	const std::string name = "/cau_test_" + std::to_string(getpid());
+	Heap              heap = Heap::create(name.c_str(), 4 * 1024 * 1024);
+	const uint64_t    free = heap.free_elements();
+
+	constexpr int PROCESSES = 4;
+	for (int p = 0; p < PROCESSES; p++) {
+		if (fork() != 0) { continue; }
+		// child: allocate concurrently with the others and check, that nobody overwrote the own allocations
+		Heap                                        child = Heap::open(name.c_str());
+		std::vector<std::pair<uint8_t *, uint64_t>> allocations;
+		for (uint64_t i = 0; i < 2000; i++) {
+			const uint64_t size = 1 + (i * 131 + p * 17) % 700;
+			uint8_t       *ptr  = child.alloc(size).begin;
+			memset(ptr, p + 1, size);
+			allocations.emplace_back(ptr, size);
+			if (i % 3 == 0) {
+				auto [old, old_size] = allocations[i / 2];
+				for (uint64_t j = 0; j < old_size; j++) {
+					if (old != nullptr && old[j] != p + 1) { _exit(1); }
+				}
+				if (old != nullptr) { child.dealloc(old); }
+				allocations[i / 2].first = nullptr;
+			}
+		}
+		for (auto [ptr, size]: allocations) {
+			if (ptr == nullptr) { continue; }
+			for (uint64_t j = 0; j < size; j++) {
+				if (ptr[j] != p + 1) { _exit(1); }
+			}
+			child.dealloc(ptr);
+		}
+		if (p == 0) {
+			// share an object with the parent
+			auto *shared = child.alloc<uint64_t>(1);
+			*shared      = 42;
+			child.set_root(child.offset_of(shared));
+		}
+		_exit(0);
+	}
+
+	bool failed = false;
+	for (int p = 0; p < PROCESSES; p++) {
+		int status = 0;
+		wait(&status);
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) { failed = true; }
+	}
+	Heap::unlink(name.c_str());
+	if (failed) {
+		std::cout << "ERROR: a process found corrupted memory" << std::endl;
+		return 1;
+	}
+
+	auto *shared = heap.at<uint64_t>(heap.root());
+	if (heap.root() == 0 || *shared != 42) {
+		std::cout << "ERROR: shared object not visible" << std::endl;
+		return 1;
+	}
+	heap.dealloc(shared);
+	if (heap.free_elements() != free) {
+		std::cout << "ERROR: shared heap leaked " << free - heap.free_elements() << " slots" << std::endl;
+		return 1;
+	}
+
+	// a process dies holding the lock, with free_elements out of sync with the free list
+	if (fork() == 0) {
+		pthread_mutex_lock(&heap.header()->lock);
+		heap.header()->free_elements -= 5;
+		_exit(0);
+	}
+	wait(nullptr);
+	if (heap.free_elements() != free) {
+		std::cout << "ERROR: free_elements not recovered after the owner died" << std::endl;
+		return 1;
+	}
+
+	// the creator died before initializing the segment
+	const std::string orphan_name = name + "_orphan";
+	const int         fd          = shm_open(orphan_name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+	if (fd < 0 || ftruncate(fd, 1024 * 1024) != 0) {
+		std::cout << "ERROR: can't create the orphan segment" << std::endl;
+		return 1;
+	}
+	close(fd);
+	bool timed_out = false;
+	try {
+		Heap::open(orphan_name.c_str(), 10);
+	} catch (const std::runtime_error &) { timed_out = true; }
+	Heap::unlink(orphan_name.c_str());
+	if (!timed_out) {
+		std::cout << "ERROR: opened an uninitialized shared heap" << std::endl;
+		return 1;
+	}
+	return 0;
+}
+
+int test_file_heap() {
+	const std::string path          = "/tmp/cau_test_file_heap_" + std::to_string(getpid());
+	const std::string snapshot_path = path + ".snapshot";
+	{
+		auto      heap   = cau::file_heap<>::create(path.c_str(), 16 << 20);
+		uint64_t *values = heap.alloc<uint64_t>(1000);
+		uint64_t *large  = heap.alloc<uint64_t>(10'000);
+		for (uint64_t i = 0; i < 1000; i++) { values[i] = i; }
+		large[9999] = 7;
+		heap.mark_dirty(values);
+		heap.set_root(values);
+		heap.checkpoint();
+
+		// nothing changed, only the allocator, the page bitmap and the header are written
+		const uint64_t idle = heap.checkpoint();
+		if (idle > cau::round_up_to_multiple(sizeof(cau::file_heap<>::heap_t), 4096) + 3 * 4096) {
+			std::cout << "ERROR: idle checkpoint wrote " << idle << " bytes" << std::endl;
+			return 1;
+		}
+		// a full file fails like any other wrapped allocator
+		if (heap.alloc(32 << 20).begin != nullptr) {
+			std::cout << "ERROR: allocation larger than the file succeeded" << std::endl;
+			return 1;
+		}
+		large[0] = 8;
+		heap.mark_dirty(large);
+		if (heap.checkpoint() < idle + 80'000) {
+			std::cout << "ERROR: checkpoint skipped a dirty large allocation" << std::endl;
+			return 1;
+		}
+		heap.snapshot(snapshot_path.c_str());
+		for (uint64_t i = 0; i < 1000; i++) { values[i] = 2 * i; }
+		heap.mark_dirty(values);
+		if (heap.checkpoint() <= idle) {
+			std::cout << "ERROR: checkpoint skipped a dirty bucket" << std::endl;
+			return 1;
+		}
+	}
+	{
+		auto      snapshot = cau::file_heap<>::open(snapshot_path.c_str(), cau::file_heap<>::MODE::PRIVATE);
+		uint64_t *values   = snapshot.root<uint64_t>();
+		for (uint64_t i = 0; i < 1000; i++) {
+			if (values[i] != i) {
+				std::cout << "ERROR: snapshot " << values[i] << " != " << i << std::endl;
+				return 1;
+			}
+		}
+		// private writes and allocations don't reach the file
+		values[0] = 42;
+		snapshot.dealloc(snapshot.alloc(100));
+	}
+	{
+		auto      heap   = cau::file_heap<>::open(path.c_str());
+		uint64_t *values = heap.root<uint64_t>();
+		for (uint64_t i = 0; i < 1000; i++) {
+			if (values[i] != 2 * i) {
+				std::cout << "ERROR: reopened " << values[i] << " != " << 2 * i << std::endl;
+				return 1;
+			}
+		}
+		heap.dealloc(values);
+		heap.set_root(nullptr);
+		heap.checkpoint();
+	}
+	{
+		auto snapshot = cau::file_heap<>::open(snapshot_path.c_str(), cau::file_heap<>::MODE::PRIVATE);
+		if (snapshot.root<uint64_t>()[0] != 0) {
+			std::cout << "ERROR: private write reached the snapshot" << std::endl;
+			return 1;
+		}
+	}
+	unlink(path.c_str());
+	unlink(snapshot_path.c_str());
+	return 0;
+}
+
 int main() {
 
 	cau::generic_allocator<cau::default_allocator> alloc;
@@ -90,6 +776,25 @@ int main() {
 		alloc.dealloc(map, 1);
 	}
 
+	cau::global_file_allocator = nullptr;
+
+	if (test_stats()) { return 1; }
+	if (test_lifetime_hints()) { return 1; }
+	if (test_handle_allocator()) { return 1; }
+	if (test_bucket_maintainer()) { return 1; }
+	if (test_heap_profiler()) { return 1; }
+	if (test_trace_recorder()) { return 1; }
+	if (test_failed_large_allocation()) { return 1; }
+	if (test_unsized_dealloc()) { return 1; }
+	if (test_large_bucket()) { return 1; }
+	if (test_sized_dealloc()) { return 1; }
+	if (test_bucket_cursor()) { return 1; }
+	if (test_fixed_size_allocation()) { return 1; }
+	if (test_shared_heap()) { return 1; }
+	if (test_file_heap()) { return 1; }
+
+	cau::global_file_allocator = &alloc;
+	if (test_aligned_allocation()) { return 1; }
 	cau::global_file_allocator = nullptr;
 	return 0;
 }